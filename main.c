@@ -1,11 +1,24 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
 
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
 #include "hardware/timer.h"
 #include "hardware/adc.h"
+#include "hardware/sync.h"
+#include "hardware/pwm.h"
+#include "hardware/uart.h"
+#include "hardware/irq.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/pio.h"
+#include "hardware/watchdog.h"
 
 /*
   Standalone NightOwl / ERB RP2040 firmware (2 lanes)
@@ -52,22 +65,172 @@
 #define PIN_M2_DIR     15
 #define PIN_M2_STEP    16
 
+#define LANE_STEPS_PER_MM   415.0f  // drive gear steps per mm of filament at TMC_MICROSTEPS
+
 #define M1_DIR_INVERT  0
 #define M2_DIR_INVERT  1
 #define EN_ACTIVE_LOW  1
 
+// TMC2209 UART (single-wire, both drivers share one pin, selected by address)
+#define USE_TMC_UART        1
+#define PIN_TMC_UART        20
+#define TMC_UART_BAUD       115200
+#define TMC_M1_ADDR         0
+#define TMC_M2_ADDR         1
+#define TMC_RSENSE_MOHM     110
+#define TMC_RUN_MA          800
+#define TMC_HOLD_MA         400
+#define TMC_MICROSTEPS      16      // must match what the step rates in this file were tuned for
+#define TMC_SPREAD_SPS      6000    // SpreadCycle above this rate, StealthChop below (0 = StealthChop only)
+
+// Steady feed via the driver's internal step generator (VACTUAL) instead of STEP pulses
+#define USE_TMC_VACTUAL_FEED   1
+#define TMC_VACTUAL_INVERT     0    // flip if VACTUAL feed runs opposite to STEP/DIR feed
+#define VACTUAL_DEADBAND_SPS   40   // ignore smaller rate changes (pot noise) to save UART traffic
+
+// StallGuard jam detection (StealthChop only, i.e. below TMC_SPREAD_SPS)
+#define TMC_SGTHRS          80      // stall when SG_RESULT <= 2*SGTHRS (0 = off)
+#define TMC_SG_MIN_SPS      1500    // StallGuard is unreliable below this rate
+#define TMC_SG_POLL_MS      20
+#define TMC_SG_SETTLE_MS    300     // ignore StallGuard right after a start
+#define TMC_SG_STALL_COUNT  3       // consecutive low readings => jam
+
 // Autoload speed (fixed)
 #define AUTOLOAD_STEPS_PER_SEC  5000
 
+// Path-length calibration ("cal <lane>" over USB), stored in flash
+#define CAL_SPS                 2000
+#define CAL_MAX_STEPS           200000  // per phase
+#define AUTOLOAD_MARGIN_PCT     25      // calibrated autoload budget = IN->OUT + margin
+#define SLIP_WARN_PCT           10      // load needed this much more than calibrated
+#define SWAP_PRESTAGE_MARGIN_STEPS  1500    // calibrated prestage stops this short of the Y-split
+
+// Tool change ("T<n>" or "tool <n>" over USB): unload the active lane to its
+// OUT park and load the target up to the Y-split
+#define TOOL_SPS                12000   // ramped on the step sequencer
+#define TOOL_PARK_SPS           3000
+#define TOOL_UNLOAD_MAX_STEPS   400000  // budget for clearing the Y-split
+#define TOOL_LOAD_MAX_STEPS     200000  // budget for reaching it, uncalibrated lane
+#define TOOL_READY_STEPS        0       // push on past the Y-split (0 = stop there, buffer feed takes over)
+
 // Timing
 #define STEP_PULSE_US           3
+#define DRIVER_EN_SETTLE_US     200     // wait after EN before the first STEP
+#define DRIVER_IDLE_HOLD_MS     3000    // keep EN after last step; 0 = release on stop, -1 = never release
 #define LOW_DELAY_S             0.40f
-#define SWAP_COOLDOWN_S         0.50f
 #define AUTOLOAD_TIMEOUT_S      6.0f
+#define DIN_PULL_SETTLE_US  20      // pull-up charge time before the first read
 #define DEBOUNCE_MS             10
 
+// Debounce profiles: integrator time to assert (switch closed) and to
+// release, per input; 0 assert = act on the first closed sample. Sampled
+// every SCHED_INPUTS_US.
+#define DEB_IN_ASSERT_MS        DEBOUNCE_MS
+#define DEB_IN_RELEASE_MS       20      // IN opening = runout, don't arm on bounce
+#define DEB_OUT_ASSERT_MS       DEBOUNCE_MS     // 0 while autoloading
+#define DEB_OUT_RELEASE_MS      DEBOUNCE_MS
+#define DEB_BUF_LOW_ASSERT_MS   DEBOUNCE_MS
+#define DEB_BUF_LOW_RELEASE_MS  DEBOUNCE_MS
+#define DEB_BUF_HIGH_ASSERT_MS  0       // stop feeding immediately
+#define DEB_BUF_HIGH_RELEASE_MS 20
+#define DEB_Y_ASSERT_MS         5
+#define DEB_Y_RELEASE_MS        20      // Y clear gates the swap: be sure
+#define DEB_BTN_ASSERT_MS       20
+#define DEB_BTN_RELEASE_MS      20
+
+// Input test bench: corrupt samples on purpose to harden the debounce
+// ("noise <profile>" over USB; "din" shows false transitions per input)
+#define USE_DIN_NOISE           0
+#define NOISE_BOUNCE_MAX_MS     6       // chatter after every real edge, uniform 0..max
+#define NOISE_SPIKE_PER_S       20      // random one-sample flips per input
+#define NOISE_MOTOR_GAIN        5       // spike rate multiplier while a motor runs
+
 #define REQUIRE_Y_CLEAR_FOR_SWAP  1
 
+// Runout prediction from lane odometry ("spool <lane> <m>|<g>g" over USB)
+#define SPOOL_LENGTH_M          330     // assumed for a freshly loaded spool (0 = unknown)
+#define SPOOL_G_PER_M           2.98f   // 1.75 mm PLA
+#define SWAP_LOG_LEN            8       // recent swaps kept for the timeline stats
+#define RUNOUT_PRESTAGE_S       20      // pre-stage the standby lane this long before predicted runout
+#define RUNOUT_RATE_TAU_S       30.0f   // consumption rate averaging
+
+// Feed sweep ("sweep [s]" over USB): extrusion profiles replayed against a
+// buffer model for a grid of LOW delays and feed rates, one stats row each
+#define SWEEP_RUN_S             120     // simulated time per row
+#define SWEEP_BUF_MM            60.0f   // buffer travel, drawn empty to pushed full
+#define SWEEP_LOW_MM            5.0f    // LOW switch closes below this fill
+#define SWEEP_HIGH_MM           45.0f   // HIGH switch closes above this fill
+#define SWEEP_TAIL_MM           100.0f  // runout: filament left between IN and the Y-split
+
+// Analog buffer position: linear hall sensor on a spare ADC channel. A PI
+// loop holds the buffer at the setpoint with continuous feed; the LOW/HIGH
+// switches stay as hard limits and the pot sets the maximum rate
+#define USE_BUF_HALL            0
+#define PIN_BUF_HALL_ADC_GPIO   27      // GPIO27 = ADC1
+#define BUF_HALL_ADC_CHANNEL    1
+#define BUF_HALL_RAW_EMPTY      800     // ADC reading with the buffer drawn to LOW
+#define BUF_HALL_RAW_FULL       3300    // ADC reading with the buffer pushed to HIGH
+#define BUF_HALL_FAULT_MARGIN   300     // readings this far outside the span = sensor fault
+#define BUF_PERIOD_MS           10
+#define BUF_SETPOINT_PCT        50
+#define BUF_PI_KP               120.0f  // sps per % below setpoint
+#define BUF_PI_KI               60.0f   // sps per %*s
+#define BUF_PI_MIN_SPS          100     // below this the lane just waits
+
+// Extruder step follower: count the printer's extruder STEP/DIR with PIO and
+// feed the active lane at the filament ratio; buffer switches only trim
+#define USE_EXT_FOLLOWER        0
+#define PIN_EXT_STEP            3
+#define PIN_EXT_DIR             4
+#define EXT_DIR_INVERT          0
+#define EXT_STEPS_PER_MM        415.0f  // printer extruder steps per mm of filament
+#define FOLLOW_PERIOD_MS        5
+#define FOLLOW_LAG_MS           40      // position loop time constant
+#define FOLLOW_TRIM_SPS         400     // extra rate while buffer LOW persists
+#define FOLLOW_MIN_SPS          100     // below this the lane just waits
+
+// Filament motion encoder per lane, counted by PIO: slip/jam detection and
+// optional distance compensation ("enc" over USB; "enc sim" without sensors)
+#define USE_FIL_ENCODER         0
+#define PIN_ENC1_A              18
+#define PIN_ENC1_B              19
+#define PIN_ENC2_A              11
+#define PIN_ENC2_B              13
+#define ENC_QUADRATURE          1       // 0 = single-channel pulse wheel on A
+#define ENC_DIR_INVERT          0       // flip if feeding counts down (quadrature)
+#define ENC_MM_PER_COUNT        1.5f    // filament per A cycle (one rising edge)
+#define ENC_WINDOW_MM           30      // commanded feed per comparison
+#define ENC_SLIP_PCT            20      // window this much short = slip warning
+#define ENC_JAM_PCT             80      // ... this much = stop the lane, latch jam
+#define ENC_COMPENSATE          0       // scale distance moves by measured slip
+#define ENC_COMP_MAX_PCT        15
+
+// Multi-board lanes over UART0 ("link" over USB): one coordinator runs the
+// policy, lane servers only execute its motion commands
+#define LINK_ROLE               0       // 0 = off, 1 = coordinator, 2 = lane server
+#define LINK_ADDR               1       // lane server: address 1..3 (lanes 2*addr+1, 2*addr+2)
+#define LINK_SERVERS            1       // coordinator: servers polled, addresses 1..n
+#define PIN_LINK_TX             0
+#define PIN_LINK_RX             1
+#define LINK_BAUD               115200
+#define LINK_POLL_MS            10      // status poll per server (= heartbeat)
+#define LINK_REPLY_TIMEOUT_US   5000
+#define LINK_RETRIES            2       // resends before the server counts as offline
+#define LINK_HEARTBEAT_MS       200     // lane server: stop the lanes when the coordinator is silent
+
+// Overlapped swap handoff: the standby lane pre-advances from its OUT park
+// toward the Y-split while the old tail clears (keep it short of the merge)
+#define SWAP_PRESTAGE_STEPS     4000    // uncalibrated lanes; 0 = no pre-advance
+#define SWAP_PRESTAGE_SPS       5000
+
+// Outgoing tail after runout: 0 = wait for the printer to pull it past the
+// Y-split, 1 = retract it back out of the Y-split, 2 = push it through
+// (push stops at buffer HIGH and falls back to waiting)
+#define SWAP_TAIL_MODE          0
+#define SWAP_TAIL_SPS           8000
+#define SWAP_TAIL_MAX_STEPS     40000   // give up and wait passively after this
+#define SWAP_TAIL_EXTRA_STEPS   800     // keep moving this far once the Y-split reads clear
+
 // Debug
 #define DEBUG_PRINTS      1
 #define DEBUG_PERIOD_US   500000
@@ -77,12 +240,52 @@
 #define PIN_STATUS_LED    17
 #define STATUS_LED_ACTIVE_HIGH 1
 
+// Hardware PWM step train for constant-rate FEED/MANUAL (software stepping below PWM_MIN_SPS)
+#define USE_PWM_STEP        1
+#define PWM_MIN_SPS         200
+
+// Distance moves (prestage, tail, calibration, bounded autoload) as
+// hardware-timed trapezoids: PIO plays per-step intervals streamed by DMA
+#define USE_STEP_SEQ        1
+#define SEQ_PIO_HZ          10000000    // state machine clock, interval resolution 0.1 us
+#define SEQ_START_SPS       1000        // start/stop rate of the ramp
+#define SEQ_ACCEL_SPS2      50000       // steps/s^2
+#define SEQ_RAMP_MAX        1536        // tabulated ramp steps (~12400 sps at the default accel)
+#define SEQ_CHUNK           64          // words per DMA buffer (two per lane)
+
 // Step catch-up guard: max pulses per loop per lane
 #define STEP_CATCHUP_GUARD  50
 
-// Main loop idle sleep (smaller => higher max step rate)
+// Main loop idle sleep cap (smaller => higher max step rate)
 #define MAIN_LOOP_SLEEP_US  100
 
+// Watchdog: fed only while the main loop and the step engine both make
+// progress; the reason for a reset is kept in scratch registers 0..3
+#define USE_WATCHDOG        1
+#define WDT_TIMEOUT_MS      500     // > max flash sector erase (W25Q: 400 ms, typ. 45 ms)
+#define WDT_LOOP_MAX_US     50000   // one loop pass slower than this = stuck
+#define WDT_STEP_LATE_US    20000   // a software step this overdue = step engine stuck
+
+// Event-driven policy: inputs are sampled only while settling after a GPIO
+// edge, the policy runs on events instead of at 1 kHz ("events" over USB)
+#define USE_EVENTS              1
+#define EVENT_ACTIVE_TICK_MS    10      // supervision while a lane moves or a swap is pending
+#define EVENT_RATE_DEADBAND_PCT 3       // smaller pot/buffer/follower rate changes aren't events
+#define EVENT_SLEEP_MAX_US      1000    // idle sleep cap (interrupts end it early)
+#define EVENT_TRACE_LEN         32
+
+// Scheduler periods (us); the step path runs every loop, these run when due
+#define SCHED_INPUTS_US     500                         // debounce, 2 kHz
+#define SCHED_POLICY_US     1000                        // feed/swap/autoload, 1 kHz
+#define SCHED_POT_US        (POT_READ_PERIOD_MS * 1000) // 20 Hz
+#define SCHED_LED_US        10000                       // 100 Hz
+#define SCHED_CLI_US        10000
+#define SCHED_FOLLOW_US     (FOLLOW_PERIOD_MS * 1000)
+#define SCHED_BUF_US        (BUF_PERIOD_MS * 1000)
+#define SCHED_ENC_US        20000
+#define SCHED_LINK_US       1000
+#define SCHED_ONDEMAND_DEADLINE_US  100000              // for triggered tasks (telemetry)
+
 // -------------------------- END CONFIG --------------------------
 
 static inline int clamp_i(int v, int lo, int hi) {
@@ -91,56 +294,428 @@ static inline int clamp_i(int v, int lo, int hi) {
     return v;
 }
 
+#if DEBUG_PRINTS
+  #define DBG_PRINTF(...) printf(__VA_ARGS__)
+#else
+  #define DBG_PRINTF(...) do{}while(0)
+#endif
+
 // ------------------------ Debounced input -----------------------
 
+/*
+  Integrator debounce: while the raw level differs from the stable one the
+  count climbs by one per sample, while it agrees the count decays; the
+  stable level flips when the count reaches the assert (closing) or
+  release (opening) threshold. Isolated bounces only delay a change, they
+  don't restart it. With `instant` a closing edge is taken on the first
+  sample. Latency is measured from the raw edge that started the change.
+*/
 typedef struct {
     uint pin;
     bool stable;
     bool last_raw;
     absolute_time_t last_edge;
+
+    uint16_t assert_n, release_n;   // samples to close / open
+    bool instant;                   // close on the first closed sample
+    uint16_t count;
+    absolute_time_t change_from;    // raw edge that started the pending change
+    uint32_t lat_last_us, lat_max_us;
+
+    uint32_t changes, false_changes;    // debounced flips, and those to a level the pin isn't at
+    bool phys;                      // real pin level (noise test bench)
+    uint16_t burst;                 // bounce samples still to inject
 } din_t;
 
-static inline void din_init(din_t *d, uint pin) {
+#if USE_DIN_NOISE
+/*
+  Noise overlay between the pin and the debouncer. Bounce: after each real
+  edge, a random-length burst of random levels. Spikes: single-sample
+  flips at NOISE_SPIKE_PER_S, NOISE_MOTOR_GAIN times more often while a
+  motor runs (stepper cable coupling).
+*/
+enum {
+    NOISE_BOUNCE = 1u << 0,
+    NOISE_SPIKE  = 1u << 1,
+    NOISE_MOTOR  = 1u << 2,
+};
+
+static uint32_t din_noise_profile;
+static bool din_noise_motors;       // set by the input task
+static uint32_t din_noise_rng = 0x2545F491u;
+
+static inline uint32_t din_noise_rand(void) {
+    uint32_t x = din_noise_rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return din_noise_rng = x;
+}
+
+static bool din_noise(din_t *d, bool phys) {
+    if (phys != d->phys && (din_noise_profile & NOISE_BOUNCE)) {
+        d->burst = (uint16_t)(din_noise_rand() % ((NOISE_BOUNCE_MAX_MS * 1000) / SCHED_INPUTS_US + 1));
+    }
+    bool v = phys;
+    if (d->burst) {
+        d->burst--;
+        v = din_noise_rand() & 1u;
+    }
+    if (din_noise_profile & (NOISE_SPIKE | NOISE_MOTOR)) {
+        uint32_t rate = NOISE_SPIKE_PER_S;
+        if ((din_noise_profile & NOISE_MOTOR) && din_noise_motors) rate *= NOISE_MOTOR_GAIN;
+        if (din_noise_rand() % 1000000u < rate * SCHED_INPUTS_US) v = !v;
+    }
+    return v;
+}
+#endif
+
+#if USE_EVENTS
+// Edge on any debounced input: the input task samples until they settle again
+static volatile bool din_irq_pending;
+
+static void din_irq(uint gpio, uint32_t events) {
+    (void)gpio;
+    (void)events;
+    din_irq_pending = true;
+}
+#endif
+
+static inline uint16_t din_samples(int ms) {
+    int n = (ms * 1000 + SCHED_INPUTS_US - 1) / SCHED_INPUTS_US;
+    return (uint16_t)(n < 1 ? 1 : n);
+}
+
+static inline void din_init(din_t *d, uint pin, int assert_ms, int release_ms) {
     d->pin = pin;
+    d->assert_n = din_samples(assert_ms);
+    d->release_n = din_samples(release_ms);
+    d->instant = (assert_ms == 0);
+    d->count = 0;
+    d->lat_last_us = d->lat_max_us = 0;
+    d->changes = d->false_changes = 0;
+    d->burst = 0;
     gpio_init(pin);
     gpio_set_dir(pin, GPIO_IN);
     gpio_pull_up(pin);
+    busy_wait_us_32(DIN_PULL_SETTLE_US); // boot state is used right away, no startup delay
 
     bool raw = gpio_get(pin);
     d->stable = raw;
     d->last_raw = raw;
     d->last_edge = get_absolute_time();
+    d->change_from = d->last_edge;
+    d->phys = raw;
+#if USE_EVENTS
+    gpio_set_irq_enabled_with_callback(pin, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, din_irq);
+#endif
 }
 
 static inline void din_update(din_t *d) {
     absolute_time_t now = get_absolute_time();
-    bool raw = gpio_get(d->pin);
+    bool phys = gpio_get(d->pin);
+#if USE_DIN_NOISE
+    bool raw = din_noise(d, phys);
+#else
+    bool raw = phys;
+#endif
+    d->phys = phys;
 
     if (raw != d->last_raw) {
         d->last_raw = raw;
         d->last_edge = now;
+        if (raw != d->stable && d->count == 0) d->change_from = now;
     }
 
-    if (raw != d->stable) {
-        if (absolute_time_diff_us(d->last_edge, now) >= (int64_t)DEBOUNCE_MS * 1000) {
-            d->stable = raw;
-        }
+    if (raw == d->stable) {
+        if (d->count) d->count--;
+        return;
     }
+
+    bool closing = (raw == 0);
+    uint16_t need = closing ? (d->instant ? 1 : d->assert_n) : d->release_n;
+    if (++d->count < need) return;
+
+    d->stable = raw;
+    d->count = 0;
+    d->changes++;
+    if (raw != phys) d->false_changes++;
+    d->lat_last_us = (uint32_t)absolute_time_diff_us(d->change_from, now);
+    if (d->lat_last_us > d->lat_max_us) d->lat_max_us = d->lat_last_us;
 }
 
 static inline bool active_low_on(const din_t *d) {
     return d->stable == 0;
 }
 
+// Integrator at rest on the debounced level: nothing to sample until the next edge
+static inline bool din_idle(const din_t *d) {
+    return d->count == 0 && d->last_raw == d->stable;
+}
+
+// ------------------------- TMC2209 UART -------------------------
+/*
+  Single-wire UART, bit-banged: the pin is driven while sending and released
+  (pull-up) while the driver answers. Interrupts are off for one datagram
+  (~0.7 ms write, ~1.2 ms read at 115200), so stepping pauses that long.
+*/
+
+#define TMC_REG_GCONF       0x00
+#define TMC_REG_IFCNT       0x02
+#define TMC_REG_IHOLD_IRUN  0x10
+#define TMC_REG_TPOWERDOWN  0x11
+#define TMC_REG_TSTEP       0x12
+#define TMC_REG_TPWMTHRS    0x13
+#define TMC_REG_TCOOLTHRS   0x14
+#define TMC_REG_VACTUAL     0x22
+#define TMC_REG_SGTHRS      0x40
+#define TMC_REG_SG_RESULT   0x41
+#define TMC_REG_CHOPCONF    0x6C
+#define TMC_REG_DRV_STATUS  0x6F
+
+#define TMC_GCONF_PDN_DISABLE       (1u << 6)
+#define TMC_GCONF_MSTEP_REG_SELECT  (1u << 7)
+#define TMC_GCONF_MULTISTEP_FILT    (1u << 8)
+#define TMC_CHOPCONF_DEFAULT        0x10000053u   // TOFF=3, HSTRT=5, intpol
+#define TMC_CHOPCONF_VSENSE         (1u << 17)
+
+#define TMC_FCLK_HZ             12000000u
+#define TMC_UART_RX_TIMEOUT_US  2000
+
+typedef struct {
+    uint8_t addr;
+    bool ok;                        // answered and accepted config
+
+    int run_ma, hold_ma;
+    int microsteps;
+    int spread_sps;
+    int sgthrs;
+
+    uint8_t sg_low_count;
+    uint16_t sg_last;
+    absolute_time_t next_sg_poll;
+    absolute_time_t sg_valid_after;
+} tmc_t;
+
+static uint8_t tmc_crc8(const uint8_t *d, int n) {
+    uint8_t crc = 0;
+    for (int i = 0; i < n; i++) {
+        uint8_t b = d[i];
+        for (int j = 0; j < 8; j++) {
+            if ((crc >> 7) ^ (b & 0x01)) crc = (uint8_t)((crc << 1) ^ 0x07);
+            else                         crc = (uint8_t)(crc << 1);
+            b >>= 1;
+        }
+    }
+    return crc;
+}
+
+#if USE_TMC_UART
+static inline void tmc_wait_until(uint32_t t) {
+    while ((int32_t)(time_us_32() - t) < 0) tight_loop_contents();
+}
+
+static inline uint32_t tmc_bit_us(uint32_t half_bits) {
+    return (half_bits * 1000000u) / (2u * TMC_UART_BAUD);
+}
+
+static void tmc_uart_init(void) {
+    gpio_init(PIN_TMC_UART);
+    gpio_pull_up(PIN_TMC_UART);
+    gpio_put(PIN_TMC_UART, 1);
+    gpio_set_dir(PIN_TMC_UART, GPIO_IN);
+}
+
+static void tmc_uart_tx(const uint8_t *buf, int n) {
+    gpio_put(PIN_TMC_UART, 1);
+    gpio_set_dir(PIN_TMC_UART, GPIO_OUT);
+
+    uint32_t t0 = time_us_32();
+    uint32_t bit = 0;
+    for (int i = 0; i < n; i++) {
+        uint16_t frame = (uint16_t)((buf[i] << 1) | 0x200);   // start 0, 8 data LSB first, stop 1
+        for (int b = 0; b < 10; b++) {
+            tmc_wait_until(t0 + tmc_bit_us(2 * bit++));
+            gpio_put(PIN_TMC_UART, (frame >> b) & 1);
+        }
+    }
+    tmc_wait_until(t0 + tmc_bit_us(2 * bit));
+
+    gpio_set_dir(PIN_TMC_UART, GPIO_IN);
+}
+
+static bool tmc_uart_rx(uint8_t *buf, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t deadline = time_us_32() + TMC_UART_RX_TIMEOUT_US;
+        while (gpio_get(PIN_TMC_UART)) {
+            if ((int32_t)(time_us_32() - deadline) >= 0) return false;
+        }
+        uint32_t t0 = time_us_32();
+
+        uint8_t v = 0;
+        for (int b = 0; b < 8; b++) {
+            tmc_wait_until(t0 + tmc_bit_us(3 + 2 * b));       // middle of data bit b
+            if (gpio_get(PIN_TMC_UART)) v |= (uint8_t)(1u << b);
+        }
+        tmc_wait_until(t0 + tmc_bit_us(19));                 // middle of stop bit
+        buf[i] = v;
+    }
+    return true;
+}
+
+static void tmc_write(uint8_t addr, uint8_t reg, uint32_t val) {
+    uint8_t d[8] = {
+        0x05, addr, (uint8_t)(reg | 0x80),
+        (uint8_t)(val >> 24), (uint8_t)(val >> 16), (uint8_t)(val >> 8), (uint8_t)val, 0
+    };
+    d[7] = tmc_crc8(d, 7);
+
+    uint32_t irq = save_and_disable_interrupts();
+    tmc_uart_tx(d, 8);
+    restore_interrupts(irq);
+
+    // bus idle gap before the next datagram
+    tmc_wait_until(time_us_32() + tmc_bit_us(2 * 4));
+}
+
+static bool tmc_read(uint8_t addr, uint8_t reg, uint32_t *val) {
+    uint8_t req[4] = { 0x05, addr, reg, 0 };
+    req[3] = tmc_crc8(req, 3);
+    uint8_t rep[8];
+
+    uint32_t irq = save_and_disable_interrupts();
+    tmc_uart_tx(req, 4);
+    bool ok = tmc_uart_rx(rep, 8);
+    restore_interrupts(irq);
+
+    if (!ok || rep[0] != 0x05 || rep[1] != 0xFF || rep[2] != reg) return false;
+    if (tmc_crc8(rep, 7) != rep[7]) return false;
+
+    *val = ((uint32_t)rep[3] << 24) | ((uint32_t)rep[4] << 16) | ((uint32_t)rep[5] << 8) | rep[6];
+    return true;
+}
+#else
+static inline void tmc_uart_init(void) {}
+static inline void tmc_write(uint8_t addr, uint8_t reg, uint32_t val) { (void)addr; (void)reg; (void)val; }
+static inline bool tmc_read(uint8_t addr, uint8_t reg, uint32_t *val) { (void)addr; (void)reg; (void)val; return false; }
+#endif
+
+// Current scale CS (0..31) for a RMS current; vsense picks the finer range when it fits
+static int tmc_current_cs(int ma, bool vsense) {
+    float vfs = vsense ? 0.180f : 0.325f;
+    float r = (TMC_RSENSE_MOHM + 20) / 1000.0f;
+    int cs = (int)(32.0f * 1.41421f * (ma / 1000.0f) * r / vfs - 1.0f + 0.5f);
+    return clamp_i(cs, 0, 31);
+}
+
+static uint32_t tmc_mres(int microsteps) {
+    uint32_t mres = 0;
+    for (int u = 256; u > 1 && u > microsteps; u >>= 1) mres++;
+    return mres;                    // 0 = 256 ... 8 = fullstep
+}
+
+// TSTEP (1/fCLK per 1/256 microstep) at a given step rate, for the velocity thresholds
+static uint32_t tmc_tstep_for_sps(const tmc_t *t, int sps) {
+    if (sps <= 0) return 0;
+    uint64_t v = ((uint64_t)TMC_FCLK_HZ * (uint64_t)t->microsteps) / (256ull * (uint64_t)sps);
+    return v > 0xFFFFFu ? 0xFFFFFu : (uint32_t)v;
+}
+
+static void tmc_defaults(tmc_t *t, uint8_t addr) {
+    memset(t, 0, sizeof(*t));
+    t->addr = addr;
+    t->run_ma = TMC_RUN_MA;
+    t->hold_ma = TMC_HOLD_MA;
+    t->microsteps = TMC_MICROSTEPS;
+    t->spread_sps = TMC_SPREAD_SPS;
+    t->sgthrs = TMC_SGTHRS;
+    t->next_sg_poll = get_absolute_time();
+    t->sg_valid_after = get_absolute_time();
+}
+
+// Push the whole configuration; ok only if the driver counted every write
+static bool tmc_apply(tmc_t *t) {
+    uint32_t cnt0, cnt1;
+    if (!tmc_read(t->addr, TMC_REG_IFCNT, &cnt0)) {
+        t->ok = false;
+        return false;
+    }
+
+    int cs_run = tmc_current_cs(t->run_ma, true);
+    bool vsense = (cs_run < 31);
+    if (!vsense) cs_run = tmc_current_cs(t->run_ma, false);
+    int cs_hold = tmc_current_cs(t->hold_ma, vsense);
+
+    uint32_t chop = (TMC_CHOPCONF_DEFAULT & ~(0xFu << 24)) | (tmc_mres(t->microsteps) << 24);
+    if (vsense) chop |= TMC_CHOPCONF_VSENSE;
+
+    tmc_write(t->addr, TMC_REG_GCONF, TMC_GCONF_PDN_DISABLE | TMC_GCONF_MSTEP_REG_SELECT | TMC_GCONF_MULTISTEP_FILT);
+    tmc_write(t->addr, TMC_REG_CHOPCONF, chop);
+    tmc_write(t->addr, TMC_REG_IHOLD_IRUN, (uint32_t)cs_hold | ((uint32_t)cs_run << 8) | (8u << 16));
+    tmc_write(t->addr, TMC_REG_TPOWERDOWN, 20);
+    tmc_write(t->addr, TMC_REG_TPWMTHRS, tmc_tstep_for_sps(t, t->spread_sps));
+    tmc_write(t->addr, TMC_REG_TCOOLTHRS, tmc_tstep_for_sps(t, TMC_SG_MIN_SPS));
+    tmc_write(t->addr, TMC_REG_SGTHRS, (uint32_t)clamp_i(t->sgthrs, 0, 255));
+    tmc_write(t->addr, TMC_REG_VACTUAL, 0);     // an MCU reset doesn't stop a running VACTUAL
+
+    t->ok = tmc_read(t->addr, TMC_REG_IFCNT, &cnt1) && ((cnt1 - cnt0) & 0xFF) == 8;
+    return t->ok;
+}
+
+// VACTUAL is in microsteps per 2^24/fCLK (~0.715 Hz)
+static inline int32_t tmc_vactual_for_sps(int sps) {
+    return (int32_t)(((int64_t)sps << 24) / TMC_FCLK_HZ);
+}
+
+// StallGuard is only meaningful in StealthChop and above the minimum rate
+static inline bool tmc_sg_usable(const tmc_t *t, int sps) {
+    if (!t->ok || t->sgthrs <= 0) return false;
+    if (sps < TMC_SG_MIN_SPS) return false;
+    if (t->spread_sps > 0 && sps >= t->spread_sps) return false;
+    return true;
+}
+
+static inline void tmc_sg_arm(tmc_t *t) {
+    t->sg_low_count = 0;
+    t->sg_valid_after = make_timeout_time_ms(TMC_SG_SETTLE_MS);
+}
+
+// Poll SG_RESULT while running; true once the load has stayed at stall level
+static bool tmc_sg_poll(tmc_t *t, int sps) {
+    if (!tmc_sg_usable(t, sps) || !time_reached(t->sg_valid_after)) {
+        t->sg_low_count = 0;
+        return false;
+    }
+    if (!time_reached(t->next_sg_poll)) return false;
+    t->next_sg_poll = make_timeout_time_ms(TMC_SG_POLL_MS);
+
+    uint32_t sg;
+    if (!tmc_read(t->addr, TMC_REG_SG_RESULT, &sg)) return false;
+    t->sg_last = (uint16_t)sg;
+
+    if (sg <= 2u * (uint32_t)t->sgthrs) {
+        if (++t->sg_low_count >= TMC_SG_STALL_COUNT) return true;
+    } else {
+        t->sg_low_count = 0;
+    }
+    return false;
+}
+
 // ---------------------------- Stepper ---------------------------
 
 typedef struct {
     uint en, dir, step;
     bool dir_invert;
+    bool enabled;
+    absolute_time_t ready_at;       // EN settle: no STEP before this
+    tmc_t tmc;
 } stepper_t;
 
-static inline void stepper_init(stepper_t *m, uint en, uint dir, uint step, bool dir_invert) {
+static inline void stepper_init(stepper_t *m, uint en, uint dir, uint step, bool dir_invert, uint8_t tmc_addr) {
     m->en = en; m->dir = dir; m->step = step; m->dir_invert = dir_invert;
+    m->enabled = false;
+    m->ready_at = get_absolute_time();
+    tmc_defaults(&m->tmc, tmc_addr);
 
     gpio_init(m->en);
     gpio_init(m->dir);
@@ -158,6 +733,10 @@ static inline void stepper_init(stepper_t *m, uint en, uint dir, uint step, bool
 }
 
 static inline void stepper_enable(stepper_t *m, bool on) {
+    if (on && !m->enabled) {
+        m->ready_at = make_timeout_time_us(DRIVER_EN_SETTLE_US);
+    }
+    m->enabled = on;
     if (EN_ACTIVE_LOW) gpio_put(m->en, on ? 0 : 1);
     else               gpio_put(m->en, on ? 1 : 0);
 }
@@ -167,10 +746,15 @@ static inline void stepper_set_dir(stepper_t *m, bool forward) {
     gpio_put(m->dir, d ? 1 : 0);
 }
 
-static inline void stepper_pulse(stepper_t *m) {
-    gpio_put(m->step, 1);
-    sleep_us(STEP_PULSE_US);
-    gpio_put(m->step, 0);
+static inline uint32_t stepper_step_mask(const stepper_t *m) {
+    return 1u << m->step;
+}
+
+// One STEP pulse on every pin in the mask, with a single pulse-width wait
+static inline void stepper_pulse_mask(uint32_t mask) {
+    gpio_set_mask(mask);
+    busy_wait_us_32(STEP_PULSE_US);
+    gpio_clr_mask(mask);
 }
 
 // ---------------------- Status LED layer ------------------------
@@ -235,22 +819,125 @@ typedef enum {
     TASK_IDLE = 0,
     TASK_AUTOLOAD,
     TASK_FEED,
-    TASK_MANUAL
+    TASK_MANUAL,
+    TASK_PRESTAGE,                  // standby lane advancing toward the Y-split
+    TASK_TAIL,                      // outgoing lane clearing its tail from the Y-split
+    TASK_CAL,                       // path-length calibration move
+    TASK_TOOL                       // tool change unload/load
 } task_mode_t;
 
+typedef enum {
+    LANE_EV_NONE = 0,
+    LANE_EV_LOADED,
+    LANE_EV_SLIP,                   // load reached OUT, but took longer than calibrated
+    LANE_EV_LOAD_FAIL               // calibrated load budget ran out before OUT
+} lane_event_t;
+
+/*
+  Motion queue: commands run back to back from the step path, so the next
+  one starts in the same pass the previous one ends, without waiting for
+  the policy. MOVE ends after `steps`; RUN ends when `until` reaches the
+  wanted state (or after `steps` if > 0, which counts as not met). Each
+  finished command leaves a completion with its tag and end position.
+*/
+#define MOTION_QUEUE_LEN  8
+#define MOTION_TAG_POLICY 0xFF      // autoload and feed queued by the policy itself
+
+typedef enum {
+    MC_MOVE = 0,
+    MC_RUN
+} motion_kind_t;
+
+typedef struct {
+    motion_kind_t kind;
+    task_mode_t mode;
+    int sps;
+    bool forward;
+    int32_t steps;                  // MOVE distance, RUN budget (-1 = none)
+    uint32_t accel;                 // steps/s^2 on the sequencer (0 = SEQ_ACCEL_SPS2)
+    const din_t *until;             // RUN: input to watch
+    bool until_on;                  // ... and the (debounced, active-low) state that ends it
+    bool decel;                     // RUN: ramp down from the trigger on the sequencer, then met
+    uint8_t tag;                    // caller's id, echoed in the completion
+} motion_cmd_t;
+
+typedef struct {
+    uint8_t tag;
+    bool met;                       // MOVE: distance done; RUN: condition reached
+    int32_t pos;                    // lane position when it ended
+} motion_done_t;
+
+typedef enum {
+    STEP_BACKEND_SW = 0,            // STEP pulses from lane_process()
+    STEP_BACKEND_VACTUAL,           // driver-internal step generator over UART
+    STEP_BACKEND_PWM,               // PWM slice on the STEP pin, pulses from time and counter
+    STEP_BACKEND_SEQ                // PIO step sequencer fed by DMA (distance moves)
+} step_backend_t;
+
+typedef struct {
+    bool ok, running;
+    PIO pio;
+    uint sm, offset;
+    uint dma[2];
+    dma_channel_config dma_cfg[2];
+    uint32_t buf[2][SEQ_CHUNK];
+    uint32_t len[2];                // words in each buffer
+    uint32_t total, gen;            // steps in the move, words generated so far
+    uint32_t done;                  // steps made, as last reported by the state machine
+    uint32_t ramp[SEQ_RAMP_MAX];    // loop counts for the first ramp_n steps
+    uint32_t ramp_n, cruise;
+} step_seq_t;
+
 typedef struct {
     din_t in_sw;
     din_t out_sw;
     stepper_t m;
 
     bool prev_in_present;
+    bool jammed;                    // StallGuard tripped; cleared by manual reverse
+    bool staged;                    // pre-advanced for a swap, ready to take over
 
     task_mode_t mode;
     absolute_time_t next_step;
     absolute_time_t autoload_deadline;
+    absolute_time_t hold_until;     // driver idle hold: release EN after this
 
     int steps_per_sec;
     bool forward;
+    int32_t steps_left;             // distance moves: steps still to go (-1 = unbounded)
+    int32_t move_start;             // position when the task started
+
+    int32_t cal_in_out;             // calibrated IN->OUT steps (0 = unknown)
+    int32_t cal_out_y;              // calibrated OUT->Y-split steps (0 = unknown)
+    lane_event_t event;             // set by the step path, consumed by the policy
+
+    float dist_scale;               // steps per commanded step, from the filament encoder
+
+    float spool_mm;                 // filament on the spool at spool_mark (0 = unknown)
+    int32_t spool_mark;             // position when spool_mm was set
+
+    step_backend_t backend;
+    int32_t position;               // steps, +forward (VACTUAL part settled on rate change)
+    int vel_sps;                    // rate currently programmed into VACTUAL (0 = not running)
+    absolute_time_t vel_since;
+
+    bool pwm_running;
+    uint pwm_slice, pwm_chan;
+    uint16_t pwm_level;             // pulse width in PWM counts
+    int pwm_sps;                    // rate the slice is currently set to
+    uint16_t pwm_top;               // TOP in effect from pwm_off counts after pwm_t0
+    uint64_t pwm_t0;                // time (us) of the last start or rate change
+    uint32_t pwm_off;               // counts from pwm_t0 to the wrap where pwm_top took over
+    uint32_t pwm_base;              // pulses started before that wrap
+
+    step_seq_t seq;
+
+    motion_cmd_t cmd;               // queued command being executed
+    bool cmd_active;
+    motion_cmd_t mq[MOTION_QUEUE_LEN];
+    uint8_t mq_head, mq_len;
+    motion_done_t md[MOTION_QUEUE_LEN];
+    uint8_t md_head, md_len;
 } lane_t;
 
 static inline bool lane_in_present(lane_t *L)  { return active_low_on(&L->in_sw); }
@@ -259,291 +946,3978 @@ static inline bool lane_out_present(lane_t *L) { return active_low_on(&L->out_sw
 static void lane_init(lane_t *L,
                       uint pin_in, uint pin_out,
                       uint pin_en, uint pin_dir, uint pin_step,
-                      bool dir_invert) {
-    din_init(&L->in_sw, pin_in);
-    din_init(&L->out_sw, pin_out);
-    stepper_init(&L->m, pin_en, pin_dir, pin_step, dir_invert);
+                      bool dir_invert, uint8_t tmc_addr) {
+    din_init(&L->in_sw, pin_in, DEB_IN_ASSERT_MS, DEB_IN_RELEASE_MS);
+    din_init(&L->out_sw, pin_out, DEB_OUT_ASSERT_MS, DEB_OUT_RELEASE_MS);
+    stepper_init(&L->m, pin_en, pin_dir, pin_step, dir_invert, tmc_addr);
 
     L->prev_in_present = false;
+    L->jammed = false;
+    L->staged = false;
     L->mode = TASK_IDLE;
     L->next_step = get_absolute_time();
     L->autoload_deadline = get_absolute_time();
+    L->hold_until = get_absolute_time();
     L->steps_per_sec = 0;
     L->forward = true;
+    L->steps_left = -1;
+    L->move_start = 0;
+    L->cal_in_out = 0;
+    L->cal_out_y = 0;
+    L->event = LANE_EV_NONE;
+    L->dist_scale = 1.0f;
+    L->spool_mm = 0.0f;
+    L->spool_mark = 0;
+    L->backend = STEP_BACKEND_SW;
+    L->position = 0;
+    L->vel_sps = 0;
+    L->vel_since = get_absolute_time();
+    L->pwm_running = false;
+    L->pwm_sps = 0;
+    L->seq.ok = false;
+    L->seq.running = false;
+    L->seq.done = 0;
+    L->cmd_active = false;
+    L->mq_head = L->mq_len = 0;
+    L->md_head = L->md_len = 0;
 }
 
-static inline int32_t step_interval_us(int sps) {
-    if (sps <= 0) return 1000000;
-    int32_t base = (int32_t)(1000000 / sps);
-    int32_t adj  = base - (int32_t)STEP_PULSE_US;
-    if (adj < 10) adj = 10;
-    return adj;
-}
-
-static inline void lane_start_task(lane_t *L, task_mode_t mode, int sps, bool forward, float timeout_s) {
-    L->mode = mode;
-    L->steps_per_sec = sps;
-    L->forward = forward;
-
-    stepper_enable(&L->m, true);
-    stepper_set_dir(&L->m, forward);
-
-    // schedule first step "now"
-    L->next_step = get_absolute_time();
-
-    if (mode == TASK_AUTOLOAD && timeout_s > 0) {
-        L->autoload_deadline = delayed_by_us(get_absolute_time(), (int64_t)(timeout_s * 1000000));
-    }
+// Steps made by the VACTUAL generator since it was last (re)programmed
+static inline int32_t lane_vel_steps(const lane_t *L) {
+    if (L->vel_sps == 0) return 0;
+    int64_t dt = absolute_time_diff_us(L->vel_since, get_absolute_time());
+    int32_t n = (int32_t)((dt * L->vel_sps) / 1000000);
+    return L->forward ? n : -n;
 }
 
-static inline void lane_stop_task(lane_t *L) {
-    L->mode = TASK_IDLE;
-    stepper_enable(&L->m, false);
-}
+static void lane_vactual_set(lane_t *L, int sps) {
+    L->position += lane_vel_steps(L);
+    L->vel_since = get_absolute_time();
+    L->vel_sps = sps;
 
-static void lane_update_inputs(lane_t *L) {
-    din_update(&L->in_sw);
-    din_update(&L->out_sw);
+    int32_t v = tmc_vactual_for_sps(sps);
+    if ((L->forward ^ L->m.dir_invert ^ TMC_VACTUAL_INVERT) == 0) v = -v;
+    tmc_write(L->m.tmc.addr, TMC_REG_VACTUAL, (uint32_t)v);
 }
 
-static void lane_process(lane_t *L) {
-    // Stop conditions
-    if (L->mode == TASK_AUTOLOAD) {
-        if (lane_out_present(L) || time_reached(L->autoload_deadline)) {
-            lane_stop_task(L);
-            return;
-        }
-    }
+#if USE_PWM_STEP
+/*
+  The STEP pin is handed to its PWM slice: each period starts with a
+  STEP_PULSE_US high pulse. The clock divider is fixed so PWM_MIN_SPS
+  still fits the 16-bit counter; rate changes only touch TOP, which is
+  double-buffered, so they take effect on the next wrap without a glitch.
 
-    if (L->mode == TASK_IDLE) return;
+  Pulses are not counted by IRQ (a wrap would be lost whenever interrupts
+  are off for longer than a period, e.g. TMC UART or flash). Instead the
+  count is worked out from the time since the current TOP took over plus
+  the slice counter, which pins down the period exactly; only a sub-period
+  time error is tolerated, so reads mask interrupts around the two samples.
+*/
+static uint32_t pwm_cnt_hz;
 
-    // Catch-up stepping: don't cap at one pulse per main loop
-    int32_t interval = step_interval_us(L->steps_per_sec);
+static void lane_pwm_init(lane_t *L) {
+    uint32_t sys_hz = clock_get_hz(clk_sys);
+    uint div = sys_hz / ((uint32_t)PWM_MIN_SPS * 65536u) + 1;
+    pwm_cnt_hz = sys_hz / div;
 
-    int guard = 0;
-    while (time_reached(L->next_step) && guard++ < STEP_CATCHUP_GUARD) {
-        stepper_pulse(&L->m);
+    L->pwm_slice = pwm_gpio_to_slice_num(L->m.step);
+    L->pwm_chan = pwm_gpio_to_channel(L->m.step);
+    L->pwm_level = (uint16_t)((pwm_cnt_hz * STEP_PULSE_US) / 1000000u + 1);
 
-        // advance from scheduled time to keep timing stable even with jitter
-        L->next_step = delayed_by_us(L->next_step, interval);
-    }
+    pwm_config cfg = pwm_get_default_config();
+    pwm_config_set_clkdiv_int(&cfg, div);
+    pwm_init(L->pwm_slice, &cfg, false);
+    pwm_set_chan_level(L->pwm_slice, L->pwm_chan, L->pwm_level);
+}
 
-    // If we hit the guard, we fell behind. Nudge schedule to "now" to avoid endless backlog.
-    if (guard >= STEP_CATCHUP_GUARD) {
-        L->next_step = get_absolute_time();
-    }
+static inline uint16_t pwm_wrap_for_sps(int sps) {
+    uint32_t top = (pwm_cnt_hz + (uint32_t)sps / 2) / (uint32_t)sps - 1;
+    return (uint16_t)(top > 65535u ? 65535u : top);
 }
 
-// ------------------------ FEED pot (ADC) ------------------------
+// Counts since pwm_top took over (negative: a rate change is still pending)
+static inline int64_t pwm_elapsed(const lane_t *L, uint64_t now) {
+    int64_t dt = (int64_t)(now - L->pwm_t0);
+    return (dt * pwm_cnt_hz) / 1000000 - (int64_t)L->pwm_off;
+}
 
-#if USE_FEED_POT
-static void feed_pot_init(void) {
-    adc_init();
-    adc_gpio_init(PIN_POT_ADC_GPIO);
-    adc_select_input(POT_ADC_CHANNEL);
+// Pulses started by `now`, with `ctr` the slice counter sampled at the same time
+static uint32_t pwm_pulses_at(const lane_t *L, uint64_t now, uint32_t ctr) {
+    int64_t e = pwm_elapsed(L, now);
+    if (e < 0) return L->pwm_base;
+    int64_t per = (int64_t)L->pwm_top + 1;
+    int64_t wraps = (e - (int64_t)ctr + per / 2) / per;
+    return L->pwm_base + (uint32_t)(wraps > 0 ? wraps : 0) + 1;
 }
 
-static int feed_pot_read_sps(void) {
-    uint16_t raw = adc_read(); // 0..4095
-    int span = (FEED_SPS_MAX - FEED_SPS_MIN);
-    int sps = FEED_SPS_MIN + (int)((raw * (uint32_t)span) / 4095u);
-    return clamp_i(sps, FEED_SPS_MIN, FEED_SPS_MAX);
+// Pulses of the running train not yet in position
+static uint32_t lane_pwm_pulses(const lane_t *L) {
+    if (!L->pwm_running) return 0;
+    uint32_t irq = save_and_disable_interrupts();
+    uint32_t ctr = pwm_get_counter(L->pwm_slice);
+    uint32_t n = pwm_pulses_at(L, time_us_64(), ctr);
+    restore_interrupts(irq);
+    return n;
 }
-#endif
 
-// ---------------------------- MAIN -----------------------------
+static void lane_pwm_start(lane_t *L) {
+    L->pwm_top = pwm_wrap_for_sps(L->steps_per_sec);
+    pwm_set_wrap(L->pwm_slice, L->pwm_top);
+    pwm_set_counter(L->pwm_slice, 0);
 
-#if DEBUG_PRINTS
-  #define DBG_PRINTF(...) printf(__VA_ARGS__)
-#else
-  #define DBG_PRINTF(...) do{}while(0)
-#endif
+    L->pwm_base = 0;                // the first pulse starts on enable
+    L->pwm_off = 0;
+    L->pwm_sps = L->steps_per_sec;
+    L->pwm_running = true;
 
-int main() {
-    stdio_init_all();
-    sleep_ms(1500);
+    gpio_set_function(L->m.step, GPIO_FUNC_PWM);
+    uint32_t irq = save_and_disable_interrupts();
+    L->pwm_t0 = time_us_64();
+    pwm_set_enabled(L->pwm_slice, true);
+    restore_interrupts(irq);
+}
 
-    status_led_init();
+// New TOP from the next wrap; written clear of a wrap so the switch-over point is known
+static void lane_pwm_set_rate(lane_t *L, int sps) {
+    uint16_t top = pwm_wrap_for_sps(sps);
+    int64_t margin = pwm_cnt_hz / 500000u;      // ~2 us
+    for (;;) {
+        uint32_t irq = save_and_disable_interrupts();
+        uint64_t now = time_us_64();
+        uint32_t c = pwm_get_counter(L->pwm_slice);
+        int64_t e = pwm_elapsed(L, now);
+        bool ok;
+        if (e < 0) {
+            ok = e + margin < 0;        // previous change not in yet: same wrap
+        } else {
+            ok = (int64_t)c + margin < (int64_t)L->pwm_top;
+            if (ok) {
+                L->pwm_base = pwm_pulses_at(L, now, c);
+                L->pwm_t0 = now;
+                L->pwm_off = (uint32_t)L->pwm_top + 1 - c;
+            }
+        }
+        if (ok) {
+            L->pwm_top = top;
+            pwm_set_wrap(L->pwm_slice, top);
+        }
+        restore_interrupts(irq);
+        if (ok) break;
+    }
+    L->pwm_sps = sps;
+}
 
-#if USE_FEED_POT
-    feed_pot_init();
-#endif
+static void lane_pwm_stop(lane_t *L) {
+    uint slice = L->pwm_slice;
+    int64_t margin = pwm_cnt_hz / 500000u;      // ~2 us before the next wrap
+    uint32_t n;
 
-    // Inputs
-    din_t y_split, buf_low, buf_high;
-    din_init(&y_split, PIN_Y_SPLIT);
-    din_init(&buf_low, PIN_BUF_LOW);
-    din_init(&buf_high, PIN_BUF_HIGH);
+    // Stop between pulses so the last one is never cut short
+    for (;;) {
+        uint32_t irq = save_and_disable_interrupts();
+        uint64_t now = time_us_64();
+        uint32_t c = pwm_get_counter(slice);
+        uint32_t top = pwm_hw->slice[slice].top;
+        if (pwm_elapsed(L, now) >= 0 && c >= L->pwm_level && (int64_t)c + margin < (int64_t)top) {
+            pwm_set_enabled(slice, false);
+            n = pwm_pulses_at(L, now, c);
+            restore_interrupts(irq);
+            break;
+        }
+        restore_interrupts(irq);
+    }
 
-    // Manual buttons
-    din_t btn_rev_l1, btn_rev_l2;
-    din_init(&btn_rev_l1, PIN_BTN_REV_L1);
-    din_init(&btn_rev_l2, PIN_BTN_REV_L2);
+    gpio_set_function(L->m.step, GPIO_FUNC_SIO);
+    gpio_put(L->m.step, 0);
 
-    // Lanes
-    lane_t L1, L2;
-    lane_init(&L1, PIN_L1_IN, PIN_L1_OUT, PIN_M1_EN, PIN_M1_DIR, PIN_M1_STEP, M1_DIR_INVERT);
-    lane_init(&L2, PIN_L2_IN, PIN_L2_OUT, PIN_M2_EN, PIN_M2_DIR, PIN_M2_STEP, M2_DIR_INVERT);
+    L->position += L->forward ? (int32_t)n : -(int32_t)n;
+    L->pwm_running = false;
+}
+#else
+static inline void lane_pwm_init(lane_t *L) { (void)L; }
+static inline void lane_pwm_start(lane_t *L) { (void)L; }
+static inline void lane_pwm_set_rate(lane_t *L, int sps) { (void)L; (void)sps; }
+static inline void lane_pwm_stop(lane_t *L) { (void)L; }
+static inline uint32_t lane_pwm_pulses(const lane_t *L) { (void)L; return 0; }
+#endif
 
-    int active_lane = 1;
-    bool swap_armed = false;
+#if USE_STEP_SEQ
+/*
+  Per-lane state machine that plays one word per step: a STEP_PULSE_US
+  pulse, then a low time of that many SEQ_PIO_HZ ticks. After each pulse
+  it pushes its step counter (Y counts down from ~0) for progress; those
+  pushes don't block and are lost while the FIFO is full, so the exact
+  count is read from Y once the state machine is stopped, and a move is
+  over when every word generated has been played.
 
-    absolute_time_t swap_cooldown_until = get_absolute_time();
-    absolute_time_t low_since = get_absolute_time();
+    0: pull block
+    1: out x, 32
+    2: set pins, 1 [SEQ_PULSE_TICKS - 3]
+    3: jmp y-- 4            ; count the step
+    4: mov isr, y
+    5: push noblock
+    6: set pins, 0
+    7: jmp x-- 7            ; low time, wrap -> 0
 
-#if DEBUG_PRINTS
-    absolute_time_t last_dbg = {0};
+  A move is a trapezoid: SEQ_START_SPS up to the lane rate at
+  SEQ_ACCEL_SPS2 and back down. The ramp is tabulated when the move is
+  planned; the DMA IRQ then only fills SEQ_CHUNK words at a time into the
+  buffer that just drained, while the other channel (chained) plays on. A
+  channel whose buffer ends the move is set to chain to itself, so nothing
+  stale gets replayed; when a stop shortens the move to what is already
+  queued, the armed channel is cut off the same way. Refills must land within one chunk of steps, so
+  keep interrupts-off sections (flash, TMC UART) shorter than that.
+*/
+#define SEQ_PULSE_TICKS  ((STEP_PULSE_US * SEQ_PIO_HZ) / 1000000)
+#define SEQ_FIXED_TICKS  (SEQ_PULSE_TICKS + 5)     // cycles per step besides the low loop
+#if SEQ_PULSE_TICKS < 3 || SEQ_PULSE_TICKS > 34
+#error "STEP_PULSE_US does not fit the sequencer's delay field at SEQ_PIO_HZ"
 #endif
 
-    // Pot throttling + live feed rate
-    absolute_time_t next_pot_read = get_absolute_time();
-    int feed_sps = 5000;
+static uint16_t seq_insn[8];
+static struct pio_program seq_prog = {
+    .instructions = seq_insn,
+    .length = 8,
+    .origin = -1,
+};
+static int seq_offset[2] = { -1, -1 };
+static step_seq_t *seq_dma_owner[NUM_DMA_CHANNELS];
 
-    while (true) {
-        absolute_time_t now = get_absolute_time();
-        int64_t t_us = to_us_since_boot(now);
+static inline uint32_t seq_loops_for_sps(float sps) {
+    float ticks = (float)SEQ_PIO_HZ / sps - SEQ_FIXED_TICKS;
+    return ticks > 0.0f ? (uint32_t)ticks : 0;
+}
 
-        // Update inputs
-        lane_update_inputs(&L1);
-        lane_update_inputs(&L2);
-        din_update(&y_split);
-        din_update(&buf_low);
-        din_update(&buf_high);
-        din_update(&btn_rev_l1);
-        din_update(&btn_rev_l2);
+// Next words of the move: the slower of the accel ramp, the decel ramp and cruise
+static uint32_t seq_fill(step_seq_t *q, uint32_t *buf) {
+    uint32_t n = 0;
+    while (n < SEQ_CHUNK && q->gen < q->total) {
+        uint32_t i = q->gen++;
+        uint32_t from_end = q->total - 1 - i;
+        uint32_t w = q->cruise;
+        if (i < q->ramp_n && q->ramp[i] > w) w = q->ramp[i];
+        if (from_end < q->ramp_n && q->ramp[from_end] > w) w = q->ramp[from_end];
+        buf[n++] = w;
+    }
+    return n;
+}
 
-        bool l1_in_present  = lane_in_present(&L1);
-        bool l2_in_present  = lane_in_present(&L2);
-        bool l1_out_present = lane_out_present(&L1);
-        bool l2_out_present = lane_out_present(&L2);
+static inline void seq_chain(step_seq_t *q, int k, bool last) {
+    channel_config_set_chain_to(&q->dma_cfg[k], last ? q->dma[k] : q->dma[k ^ 1]);
+    dma_channel_set_config(q->dma[k], &q->dma_cfg[k], false);
+}
 
-        bool buffer_low  = active_low_on(&buf_low);
-        bool buffer_high = active_low_on(&buf_high);
+static void seq_arm(step_seq_t *q, int k) {
+    q->len[k] = seq_fill(q, q->buf[k]);
+    if (q->len[k] == 0) {
+        // Nothing left for this channel: the other one holds the end of the move
+        seq_chain(q, k ^ 1, true);
+        return;
+    }
+    seq_chain(q, k, q->gen == q->total);
+    dma_channel_set_read_addr(q->dma[k], q->buf[k], false);
+    dma_channel_set_trans_count(q->dma[k], q->len[k], false);
+}
 
-        bool y_present = active_low_on(&y_split);
-        bool y_clear = !y_present;
+static void seq_dma_isr(void) {
+    uint32_t ints = dma_hw->ints0;
+    dma_hw->ints0 = ints;
+    for (uint ch = 0; ints; ch++, ints >>= 1) {
+        if (!(ints & 1u)) continue;
+        step_seq_t *q = seq_dma_owner[ch];
+        if (q && q->running) seq_arm(q, ch == q->dma[1]);
+    }
+}
 
-        bool rev_l1 = active_low_on(&btn_rev_l1);
-        bool rev_l2 = active_low_on(&btn_rev_l2);
-        bool any_manual = rev_l1 || rev_l2;
+static void lane_seq_init(lane_t *L) {
+    static bool irq_installed = false;
+    step_seq_t *q = &L->seq;
 
-#if USE_FEED_POT
-        if (time_reached(next_pot_read)) {
-            next_pot_read = delayed_by_ms(now, POT_READ_PERIOD_MS);
-            feed_sps = feed_pot_read_sps();
-        }
-#endif
+    seq_insn[0] = pio_encode_pull(false, true);
+    seq_insn[1] = pio_encode_out(pio_x, 32);
+    seq_insn[2] = pio_encode_set(pio_pins, 1) | pio_encode_delay(SEQ_PULSE_TICKS - 3);
+    seq_insn[3] = pio_encode_jmp_y_dec(4);
+    seq_insn[4] = pio_encode_mov(pio_isr, pio_y);
+    seq_insn[5] = pio_encode_push(false, false);
+    seq_insn[6] = pio_encode_set(pio_pins, 0);
+    seq_insn[7] = pio_encode_jmp_x_dec(7);
 
-        // ---------- Manual reverse per lane (fixed speed) ----------
-        if (rev_l1) {
-            if (L1.mode != TASK_MANUAL || L1.forward != false || L1.steps_per_sec != REV_STEPS_PER_SEC) {
-                lane_start_task(&L1, TASK_MANUAL, REV_STEPS_PER_SEC, false, 0.0f);
+    q->ok = false;
+    for (int i = 0; i < 2 && !q->ok; i++) {
+        PIO pio = i ? pio1 : pio0;
+        int sm = pio_claim_unused_sm(pio, false);
+        if (sm < 0) continue;
+        if (seq_offset[i] < 0) {
+            if (!pio_can_add_program(pio, &seq_prog)) {
+                pio_sm_unclaim(pio, (uint)sm);
+                continue;
             }
-        } else if (L1.mode == TASK_MANUAL) {
-            lane_stop_task(&L1);
+            seq_offset[i] = (int)pio_add_program(pio, &seq_prog);
         }
+        q->pio = pio;
+        q->sm = (uint)sm;
+        q->offset = (uint)seq_offset[i];
+        q->ok = true;
+    }
+    if (!q->ok) return;
 
-        if (rev_l2) {
-            if (L2.mode != TASK_MANUAL || L2.forward != false || L2.steps_per_sec != REV_STEPS_PER_SEC) {
-                lane_start_task(&L2, TASK_MANUAL, REV_STEPS_PER_SEC, false, 0.0f);
-            }
-        } else if (L2.mode == TASK_MANUAL) {
-            lane_stop_task(&L2);
-        }
+    int d0 = dma_claim_unused_channel(false);
+    int d1 = dma_claim_unused_channel(false);
+    if (d0 < 0 || d1 < 0) {
+        if (d0 >= 0) dma_channel_unclaim((uint)d0);
+        pio_sm_unclaim(q->pio, q->sm);
+        q->ok = false;
+        return;
+    }
+    q->dma[0] = (uint)d0;
+    q->dma[1] = (uint)d1;
 
-        // ---------- Normal behavior (only if no manual) ----------
-        if (!any_manual) {
-            // Autoload on IN rising edge
-            if (l1_in_present && !L1.prev_in_present && !l1_out_present && L1.mode == TASK_IDLE) {
-                lane_start_task(&L1, TASK_AUTOLOAD, AUTOLOAD_STEPS_PER_SEC, true, AUTOLOAD_TIMEOUT_S);
-            }
-            if (l2_in_present && !L2.prev_in_present && !l2_out_present && L2.mode == TASK_IDLE) {
-                lane_start_task(&L2, TASK_AUTOLOAD, AUTOLOAD_STEPS_PER_SEC, true, AUTOLOAD_TIMEOUT_S);
-            }
+    pio_sm_config cfg = pio_get_default_sm_config();
+    sm_config_set_wrap(&cfg, q->offset, q->offset + 7);
+    sm_config_set_set_pins(&cfg, L->m.step, 1);
+    sm_config_set_clkdiv(&cfg, (float)clock_get_hz(clk_sys) / SEQ_PIO_HZ);
+    pio_sm_init(q->pio, q->sm, q->offset, &cfg);
+    pio_sm_set_consecutive_pindirs(q->pio, q->sm, L->m.step, 1, true);
 
-            // Buffer hysteresis: need_feed when LOW persists and HIGH not active
-            if (!buffer_low) low_since = now;
-            bool low_persist = absolute_time_diff_us(low_since, now) > (int64_t)(LOW_DELAY_S * 1000000);
-            bool need_feed = buffer_low && low_persist && !buffer_high;
+    for (int k = 0; k < 2; k++) {
+        dma_channel_config c = dma_channel_get_default_config(q->dma[k]);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_dreq(&c, pio_get_dreq(q->pio, q->sm, true));
+        q->dma_cfg[k] = c;
+        dma_channel_configure(q->dma[k], &c, &q->pio->txf[q->sm], q->buf[k], 0, false);
+        seq_dma_owner[q->dma[k]] = q;
+        dma_channel_set_irq0_enabled(q->dma[k], true);
+    }
 
-            // Arm swap when active lane IN empty
-            if (active_lane == 1 && !l1_in_present) swap_armed = true;
-            if (active_lane == 2 && !l2_in_present) swap_armed = true;
+    if (!irq_installed) {
+        irq_set_exclusive_handler(DMA_IRQ_0, seq_dma_isr);
+        irq_set_enabled(DMA_IRQ_0, true);
+        irq_installed = true;
+    }
+}
 
-            bool in_cooldown = !time_reached(swap_cooldown_until);
+// Tabulate the ramp for a move of `steps` up to `sps`
+static void lane_seq_plan(lane_t *L, uint32_t steps, int sps, uint32_t accel) {
+    step_seq_t *q = &L->seq;
+    float a = (float)(accel ? accel : SEQ_ACCEL_SPS2);
+    float v0 = (float)(sps < SEQ_START_SPS ? sps : SEQ_START_SPS);
+    float v1 = (float)sps;
+    float r = (v1 * v1 - v0 * v0) / (2.0f * a);
 
-            // Execute swap
-            bool allow_swap = need_feed && swap_armed;
-#if REQUIRE_Y_CLEAR_FOR_SWAP
-            allow_swap = allow_swap && y_clear;
-#endif
-            if (!in_cooldown && allow_swap) {
-                if (active_lane == 1 && l2_out_present) {
-                    active_lane = 2;
-                    swap_armed = false;
-                    swap_cooldown_until = delayed_by_ms(now, (int32_t)(SWAP_COOLDOWN_S * 1000));
-                } else if (active_lane == 2 && l1_out_present) {
-                    active_lane = 1;
-                    swap_armed = false;
-                    swap_cooldown_until = delayed_by_ms(now, (int32_t)(SWAP_COOLDOWN_S * 1000));
-                }
+    uint32_t n = (uint32_t)r;
+    if (n > SEQ_RAMP_MAX) {
+        // Table full: cruise at the rate the ramp ends on instead of jumping to sps
+        n = SEQ_RAMP_MAX;
+        v1 = sqrtf(v0 * v0 + 2.0f * a * (float)n);
+    }
+    if (n > (steps + 1) / 2) n = (steps + 1) / 2;
+    for (uint32_t i = 0; i < n; i++) {
+        q->ramp[i] = seq_loops_for_sps(sqrtf(v0 * v0 + 2.0f * a * (float)i));
+    }
+    q->ramp_n = n;
+    q->cruise = seq_loops_for_sps(v1);
+    q->total = steps;
+    q->gen = 0;
+}
+
+static void lane_seq_start(lane_t *L) {
+    step_seq_t *q = &L->seq;
+    pio_sm_set_enabled(q->pio, q->sm, false);
+    pio_sm_clear_fifos(q->pio, q->sm);
+    pio_sm_restart(q->pio, q->sm);
+    pio_sm_exec(q->pio, q->sm, pio_encode_set(pio_pins, 0));
+    pio_sm_exec(q->pio, q->sm, pio_encode_mov_not(pio_y, pio_null));
+    pio_sm_exec(q->pio, q->sm, pio_encode_jmp(q->offset));
+
+    q->done = 0;
+    q->running = true;
+    seq_arm(q, 0);
+    seq_arm(q, 1);
+
+    gpio_set_function(L->m.step, q->pio == pio0 ? GPIO_FUNC_PIO0 : GPIO_FUNC_PIO1);
+    pio_sm_set_enabled(q->pio, q->sm, true);
+    dma_channel_start(q->dma[0]);
+}
+
+// Steps made so far, at least (newest counter value that made it into the FIFO)
+static inline uint32_t lane_seq_poll(lane_t *L) {
+    step_seq_t *q = &L->seq;
+    while (!pio_sm_is_rx_fifo_empty(q->pio, q->sm)) q->done = ~pio_sm_get(q->pio, q->sm);
+    return q->done;
+}
+
+// State machine blocked on pull with an empty FIFO: the last step's interval is over
+static inline bool lane_seq_idle(const lane_t *L) {
+    const step_seq_t *q = &L->seq;
+    return pio_sm_is_tx_fifo_empty(q->pio, q->sm) && pio_sm_get_pc(q->pio, q->sm) == q->offset;
+}
+
+// All words generated, sent and played out
+static inline bool lane_seq_finished(const lane_t *L) {
+    const step_seq_t *q = &L->seq;
+    return q->gen == q->total &&
+           !dma_channel_is_busy(q->dma[0]) && !dma_channel_is_busy(q->dma[1]) &&
+           lane_seq_idle(L);
+}
+
+// Exact step count of a stopped (or paused) state machine: copy Y out through the FIFO
+static uint32_t seq_count(step_seq_t *q) {
+    while (!pio_sm_is_rx_fifo_empty(q->pio, q->sm)) (void)pio_sm_get(q->pio, q->sm);
+    pio_sm_exec(q->pio, q->sm, pio_encode_mov(pio_isr, pio_y));
+    pio_sm_exec(q->pio, q->sm, pio_encode_push(false, false));
+    return ~pio_sm_get(q->pio, q->sm);
+}
+
+static void lane_seq_stop(lane_t *L) {
+    step_seq_t *q = &L->seq;
+    uint32_t mask = (1u << q->dma[0]) | (1u << q->dma[1]);
+
+    // No more words: stop DMA, drop what is queued, let the current step finish
+    q->running = false;
+    dma_channel_set_irq0_enabled(q->dma[0], false);
+    dma_channel_set_irq0_enabled(q->dma[1], false);
+    dma_hw->abort = mask;
+    while (dma_hw->abort & mask) tight_loop_contents();
+    dma_hw->ints0 = mask;
+    dma_channel_set_irq0_enabled(q->dma[0], true);
+    dma_channel_set_irq0_enabled(q->dma[1], true);
+
+    pio_sm_set_enabled(q->pio, q->sm, false);
+    pio_sm_clear_fifos(q->pio, q->sm);
+    pio_sm_set_enabled(q->pio, q->sm, true);
+    while (!lane_seq_idle(L)) tight_loop_contents();     // at most one interval
+    pio_sm_set_enabled(q->pio, q->sm, false);
+
+    gpio_set_function(L->m.step, GPIO_FUNC_SIO);
+    gpio_put(L->m.step, 0);
+
+    uint32_t n = seq_count(q);
+    L->position += L->forward ? (int32_t)n : -(int32_t)n;
+    q->done = 0;
+}
+
+/*
+  The move now ends with the words already queued. The idle channel is
+  armed (or already drained), so it must not chain on; if the playing one
+  finished a moment ago, its pending IRQ arms nothing and cuts the other.
+*/
+static void seq_cut(step_seq_t *q) {
+    for (int k = 0; k < 2; k++) {
+        if (!dma_channel_is_busy(q->dma[k])) seq_chain(q, k, true);
+    }
+}
+
+// Ramp down from wherever the generator is: words already queued still play
+static void lane_seq_decel(lane_t *L) {
+    step_seq_t *q = &L->seq;
+    uint32_t irq = save_and_disable_interrupts();
+    uint32_t down = q->gen < q->ramp_n ? q->gen : q->ramp_n;
+    if (q->gen + down < q->total) q->total = q->gen + down;
+    if (q->gen == q->total) seq_cut(q);
+    restore_interrupts(irq);
+}
+
+// Shorten a running move; words already queued still play. The FIFO only
+// holds the oldest counts, so pause the state machine for the live one
+static void lane_seq_truncate(lane_t *L, uint32_t left) {
+    step_seq_t *q = &L->seq;
+    uint32_t irq = save_and_disable_interrupts();
+    pio_sm_set_enabled(q->pio, q->sm, false);
+    q->done = seq_count(q);
+    pio_sm_set_enabled(q->pio, q->sm, true);
+    uint32_t total = q->done + left;
+    q->total = total > q->gen ? total : q->gen;
+    if (q->gen == q->total) seq_cut(q);
+    restore_interrupts(irq);
+}
+#else
+static inline void lane_seq_init(lane_t *L) { (void)L; }
+static inline void lane_seq_plan(lane_t *L, uint32_t steps, int sps, uint32_t accel) { (void)L; (void)steps; (void)sps; (void)accel; }
+static inline void lane_seq_start(lane_t *L) { (void)L; }
+static inline uint32_t lane_seq_poll(lane_t *L) { (void)L; return 0; }
+static inline bool lane_seq_finished(const lane_t *L) { (void)L; return true; }
+static inline void lane_seq_stop(lane_t *L) { (void)L; }
+static inline void lane_seq_truncate(lane_t *L, uint32_t left) { (void)L; (void)left; }
+static inline void lane_seq_decel(lane_t *L) { (void)L; }
+#endif
+
+static inline int32_t lane_position(const lane_t *L) {
+    int32_t hw = (int32_t)lane_pwm_pulses(L) + (int32_t)L->seq.done;
+    return L->position + lane_vel_steps(L) + (L->forward ? hw : -hw);
+}
+
+// Steady feed can run on VACTUAL or PWM; everything position-critical stays on STEP/DIR
+static inline step_backend_t lane_pick_backend(const lane_t *L, task_mode_t mode, int sps) {
+#if USE_TMC_UART && USE_TMC_VACTUAL_FEED && !USE_EXT_FOLLOWER
+    // (the follower retunes the rate every few ms, too often for UART writes)
+    if (mode == TASK_FEED && L->m.tmc.ok) return STEP_BACKEND_VACTUAL;
+#endif
+#if USE_PWM_STEP
+    if ((mode == TASK_FEED || mode == TASK_MANUAL) && sps >= PWM_MIN_SPS) return STEP_BACKEND_PWM;
+#endif
+    (void)L; (void)mode; (void)sps;
+    return STEP_BACKEND_SW;
+}
+
+static inline int32_t step_interval_us(int sps) {
+    if (sps <= 0) return 1000000;
+    int32_t base = (int32_t)(1000000 / sps);
+    int32_t adj  = base - (int32_t)STEP_PULSE_US;
+    if (adj < 10) adj = 10;
+    return adj;
+}
+
+static uint32_t boot_first_step_us;    // time since reset of the first step (0 = none yet)
+
+static void lane_motion_end(lane_t *L, bool met) {
+    L->cmd_active = false;
+    if (L->md_len == MOTION_QUEUE_LEN) {        // nobody is reading: drop the oldest
+        L->md_head = (uint8_t)((L->md_head + 1) % MOTION_QUEUE_LEN);
+        L->md_len--;
+    }
+    motion_done_t *d = &L->md[(L->md_head + L->md_len++) % MOTION_QUEUE_LEN];
+    d->tag = L->cmd.tag;
+    d->met = met;
+    d->pos = lane_position(L);
+}
+
+// Anything started or stopped from outside the queue cancels it
+static inline void lane_motion_abort(lane_t *L) {
+    if (L->cmd_active) lane_motion_end(L, false);
+    L->mq_len = 0;
+}
+
+static inline void lane_start_task(lane_t *L, task_mode_t mode, int sps, bool forward) {
+    if (L->vel_sps != 0) lane_vactual_set(L, 0);
+    if (L->pwm_running) lane_pwm_stop(L);
+    if (L->seq.running) lane_seq_stop(L);
+    if (L->cmd_active) lane_motion_abort(L);
+
+    L->mode = mode;
+    L->steps_per_sec = sps;
+    L->forward = forward;
+    L->steps_left = -1;
+    L->out_sw.instant = (mode == TASK_AUTOLOAD) || DEB_OUT_ASSERT_MS == 0;  // OUT ends a load on first contact
+    L->move_start = lane_position(L);
+    L->staged = false;
+    L->backend = lane_pick_backend(L, mode, sps);
+
+    // Driver may still be held from the last task: then the first step is
+    // immediate, otherwise it waits out the EN settle time.
+    stepper_enable(&L->m, true);
+    stepper_set_dir(&L->m, forward);
+
+    L->next_step = L->m.ready_at;
+    if (time_reached(L->next_step)) L->next_step = get_absolute_time();
+    if (!boot_first_step_us) boot_first_step_us = (uint32_t)to_us_since_boot(L->next_step);
+
+    tmc_sg_arm(&L->m.tmc);
+}
+
+static inline void lane_halt(lane_t *L) {
+    if (L->vel_sps != 0) lane_vactual_set(L, 0);
+    if (L->pwm_running) lane_pwm_stop(L);
+    if (L->seq.running) lane_seq_stop(L);
+    L->mode = TASK_IDLE;
+    L->out_sw.instant = (DEB_OUT_ASSERT_MS == 0);
+#if DRIVER_IDLE_HOLD_MS == 0
+    stepper_enable(&L->m, false);
+#else
+    // Keep the driver energized so a quick restart doesn't lose microstep position
+    L->hold_until = make_timeout_time_ms(DRIVER_IDLE_HOLD_MS > 0 ? DRIVER_IDLE_HOLD_MS : 0);
+#endif
+}
+
+static inline void lane_stop_task(lane_t *L) {
+    lane_halt(L);
+    lane_motion_abort(L);
+}
+
+// Bounded moves go to the step sequencer when there is one
+static inline void lane_set_distance(lane_t *L, int32_t steps, uint32_t accel) {
+#if ENC_COMPENSATE
+    if (steps > 0) steps = (int32_t)((float)steps * L->dist_scale + 0.5f);
+#endif
+    L->steps_left = steps;
+    if (L->seq.ok && steps > 0) {
+        lane_seq_plan(L, (uint32_t)steps, L->steps_per_sec, accel);
+        L->backend = STEP_BACKEND_SEQ;
+    }
+}
+
+// Distance move on STEP/DIR; lane_process() stops it after the last step
+static inline void lane_start_move(lane_t *L, task_mode_t mode, int sps, bool forward, int32_t steps) {
+    lane_start_task(L, mode, sps, forward);
+    lane_set_distance(L, steps, 0);
+}
+
+static void lane_motion_next(lane_t *L) {
+    if (L->mq_len == 0) return;
+    L->cmd = L->mq[L->mq_head];
+    L->mq_head = (uint8_t)((L->mq_head + 1) % MOTION_QUEUE_LEN);
+    L->mq_len--;
+
+    const motion_cmd_t *c = &L->cmd;
+    lane_start_task(L, c->mode, c->sps, c->forward);
+    if (c->steps > 0) lane_set_distance(L, c->steps, c->accel);
+    L->cmd_active = true;
+}
+
+// Queue a command; starts at once if the lane has nothing else to do
+static bool lane_motion_push(lane_t *L, const motion_cmd_t *c) {
+    if (L->mq_len == MOTION_QUEUE_LEN) return false;
+    if (!L->cmd_active && L->mode != TASK_IDLE) return false;   // busy outside the queue
+    L->mq[(L->mq_head + L->mq_len++) % MOTION_QUEUE_LEN] = *c;
+    if (!L->cmd_active) lane_motion_next(L);
+    return true;
+}
+
+static inline bool lane_motion_done(lane_t *L, motion_done_t *d) {
+    if (L->md_len == 0) return false;
+    *d = L->md[L->md_head];
+    L->md_head = (uint8_t)((L->md_head + 1) % MOTION_QUEUE_LEN);
+    L->md_len--;
+    return true;
+}
+
+static inline bool lane_motion_busy(const lane_t *L) {
+    return L->cmd_active || L->mq_len > 0;
+}
+
+// Step path: end the running command when it is done and start the next one
+static void lane_motion_service(lane_t *L) {
+    if (!L->cmd_active) return;
+    bool met = L->cmd.until && active_low_on(L->cmd.until) == L->cmd.until_on;
+    if (met && L->cmd.decel && L->backend == STEP_BACKEND_SEQ && L->seq.running) {
+        // Finish as a move: the ramp's last step completes it as met
+        L->cmd.kind = MC_MOVE;
+        L->cmd.until = NULL;
+        lane_seq_decel(L);
+        return;
+    }
+    if (!met && L->steps_left != 0) return;
+    if (L->cmd.kind == MC_MOVE) met = true;
+    lane_halt(L);
+    lane_motion_end(L, met);
+    lane_motion_next(L);
+}
+
+#if LINK_ROLE
+// Stop with a ramp where the sequencer runs, at once otherwise; drops the queue
+static void lane_stop_decel(lane_t *L) {
+    if (!(L->backend == STEP_BACKEND_SEQ && L->seq.running)) {
+        lane_stop_task(L);
+        return;
+    }
+    L->mq_len = 0;
+    L->cmd.kind = MC_RUN;           // a cut-short command completes as not met
+    L->cmd.until = NULL;
+    lane_seq_decel(L);
+}
+#endif
+
+// Cut a running distance move short (no effect if fewer steps are left)
+static inline void lane_limit_distance(lane_t *L, int32_t steps) {
+    if (L->steps_left <= steps) return;
+    if (L->backend == STEP_BACKEND_SEQ && L->seq.running) lane_seq_truncate(L, (uint32_t)steps);
+    else L->steps_left = steps;
+}
+
+// Release EN once the idle hold has expired
+static inline void lane_idle_release(lane_t *L) {
+#if DRIVER_IDLE_HOLD_MS > 0
+    if (L->m.enabled && time_reached(L->hold_until)) {
+        stepper_enable(&L->m, false);
+    }
+#else
+    (void)L;
+#endif
+}
+
+// Stop conditions and hardware backends; true if the lane needs software steps
+static bool lane_process(lane_t *L) {
+    // Stop conditions
+    if (L->mode == TASK_AUTOLOAD) {
+        if (lane_out_present(L)) {
+            int32_t used = lane_position(L) - L->move_start;
+            bool slip = L->cal_in_out > 0 && (int64_t)used * 100 > (int64_t)L->cal_in_out * (100 + SLIP_WARN_PCT);
+            L->event = slip ? LANE_EV_SLIP : LANE_EV_LOADED;
+            // A feed queued behind the load takes over in this same pass
+            lane_halt(L);
+            if (L->cmd_active) lane_motion_end(L, true);
+            lane_motion_next(L);
+        } else if (L->steps_left == 0) {
+            lane_stop_task(L);
+            L->jammed = true;
+            L->event = LANE_EV_LOAD_FAIL;
+            return false;
+        } else if (time_reached(L->autoload_deadline)) {
+            lane_stop_task(L);
+            return false;
+        }
+    }
+
+    lane_motion_service(L);
+
+    if (L->mode != TASK_IDLE && L->steps_left == 0) {
+        bool prestage = (L->mode == TASK_PRESTAGE);
+        lane_stop_task(L);
+        L->staged = prestage;
+        return false;
+    }
+
+    if (L->mode == TASK_IDLE) {
+        lane_idle_release(L);
+        return false;
+    }
+
+    if (L->backend == STEP_BACKEND_VACTUAL) {
+        // Start once EN has settled, then only follow real rate changes
+        if (!time_reached(L->next_step)) return false;
+        if (L->vel_sps == 0 || abs(L->steps_per_sec - L->vel_sps) > VACTUAL_DEADBAND_SPS) {
+            lane_vactual_set(L, L->steps_per_sec);
+        }
+        return false;
+    }
+
+    if (L->backend == STEP_BACKEND_SEQ) {
+        // Start once EN has settled; done only once the last interval is over
+        if (!L->seq.running) {
+            if (!time_reached(L->next_step)) return false;
+            lane_seq_start(L);
+        }
+        uint32_t done = lane_seq_poll(L);
+        if (lane_seq_finished(L)) L->steps_left = 0;
+        else L->steps_left = done < L->seq.total ? (int32_t)(L->seq.total - done) : 1;
+        return false;
+    }
+
+    if (L->backend == STEP_BACKEND_PWM) {
+        if (L->steps_per_sec >= PWM_MIN_SPS) {
+            // Reprogram only on an actual rate change (pot update)
+            if (!time_reached(L->next_step)) return false;
+            if (!L->pwm_running) lane_pwm_start(L);
+            else if (L->steps_per_sec != L->pwm_sps) lane_pwm_set_rate(L, L->steps_per_sec);
+            return false;
+        }
+        // Too slow for the PWM counter: continue in software
+        if (L->pwm_running) lane_pwm_stop(L);
+        L->backend = STEP_BACKEND_SW;
+        L->next_step = get_absolute_time();
+    }
+
+    return true;
+}
+
+/*
+  Software stepping for all lanes at once: every lane due in this pass goes
+  into one mask, so their pulses rise and fall together and the pulse-width
+  wait is paid once per pass, not once per lane.
+*/
+#define STEP_BATCH_MAX  8
+
+static void step_pulse_batch(lane_t *const *lanes, int n) {
+    int32_t interval[STEP_BATCH_MAX];
+    int pulses[STEP_BATCH_MAX];
+    for (int i = 0; i < n; i++) {
+        interval[i] = step_interval_us(lanes[i]->steps_per_sec);
+        pulses[i] = 0;
+    }
+
+    // Catch-up stepping: don't cap at one pulse per main loop
+    for (int guard = 0; guard < STEP_CATCHUP_GUARD; guard++) {
+        uint32_t mask = 0;
+        uint32_t due = 0;
+        for (int i = 0; i < n; i++) {
+            if (lanes[i]->steps_left != 0 && time_reached(lanes[i]->next_step)) {
+                mask |= stepper_step_mask(&lanes[i]->m);
+                due |= 1u << i;
+            }
+        }
+        if (!mask) break;
+
+        stepper_pulse_mask(mask);
+
+        for (int i = 0; i < n; i++) {
+            if (!(due & (1u << i))) continue;
+            lane_t *L = lanes[i];
+            L->position += L->forward ? 1 : -1;
+            if (L->steps_left > 0) L->steps_left--;
+            pulses[i]++;
+
+            // advance from scheduled time to keep timing stable even with jitter
+            L->next_step = delayed_by_us(L->next_step, interval[i]);
+        }
+    }
+
+    // If a lane hit the guard, it fell behind. Nudge its schedule to "now" to avoid endless backlog.
+    for (int i = 0; i < n; i++) {
+        if (pulses[i] >= STEP_CATCHUP_GUARD) lanes[i]->next_step = get_absolute_time();
+    }
+}
+
+// Autoload runs to OUT on the motion queue, so a feed can wait behind it.
+// Bounded by distance once the lane is calibrated, by time otherwise
+static void lane_start_autoload(lane_t *L) {
+    int32_t budget = L->cal_in_out > 0 ? L->cal_in_out + (L->cal_in_out * AUTOLOAD_MARGIN_PCT) / 100 : -1;
+    motion_cmd_t c = {
+        .kind = MC_RUN, .mode = TASK_AUTOLOAD, .sps = AUTOLOAD_STEPS_PER_SEC, .forward = true,
+        .steps = budget, .until = &L->out_sw, .until_on = true, .tag = MOTION_TAG_POLICY,
+    };
+    if (!lane_motion_push(L, &c)) return;
+    L->autoload_deadline = budget > 0 ? at_the_end_of_time
+                                      : make_timeout_time_ms((uint32_t)(AUTOLOAD_TIMEOUT_S * 1000));
+}
+
+// Feed behind a running autoload; starts the moment OUT is reached
+static void lane_queue_feed(lane_t *L, int sps) {
+    motion_cmd_t c = {
+        .kind = MC_RUN, .mode = TASK_FEED, .sps = sps, .forward = true, .steps = -1, .tag = MOTION_TAG_POLICY,
+    };
+    lane_motion_push(L, &c);
+}
+
+// Pre-advance distance: stop short of the calibrated Y-split if known
+static inline int32_t lane_prestage_steps(const lane_t *L) {
+    if (L->cal_out_y > SWAP_PRESTAGE_MARGIN_STEPS) return L->cal_out_y - SWAP_PRESTAGE_MARGIN_STEPS;
+    return SWAP_PRESTAGE_STEPS;
+}
+
+// StallGuard jam check for a running lane; stops it and latches the fault
+static bool lane_check_stall(lane_t *L) {
+    if (L->mode != TASK_FEED && L->mode != TASK_AUTOLOAD) return false;
+    if (!tmc_sg_poll(&L->m.tmc, L->steps_per_sec)) return false;
+
+    lane_stop_task(L);
+    L->jammed = true;
+    return true;
+}
+
+// ------------------------ FEED pot (ADC) ------------------------
+
+#if USE_FEED_POT
+static void feed_pot_init(void) {
+    adc_init();
+    adc_gpio_init(PIN_POT_ADC_GPIO);
+}
+
+static int feed_pot_read_sps(void) {
+    adc_select_input(POT_ADC_CHANNEL); // ADC is shared with the buffer sensor
+    uint16_t raw = adc_read(); // 0..4095
+    int span = (FEED_SPS_MAX - FEED_SPS_MIN);
+    int sps = FEED_SPS_MIN + (int)((raw * (uint32_t)span) / 4095u);
+    return clamp_i(sps, FEED_SPS_MIN, FEED_SPS_MAX);
+}
+#endif
+
+// -------------------- Buffer position (hall) ---------------------
+
+#if USE_BUF_HALL
+static void buf_hall_init(void) {
+    adc_init();
+    adc_gpio_init(PIN_BUF_HALL_ADC_GPIO);
+}
+
+// Buffer fill in percent (0 = drawn to LOW, 100 = at HIGH), or -1 on sensor fault
+static float buf_hall_read_pct(void) {
+    adc_select_input(BUF_HALL_ADC_CHANNEL);
+    int raw = adc_read();
+    const int lo = BUF_HALL_RAW_EMPTY < BUF_HALL_RAW_FULL ? BUF_HALL_RAW_EMPTY : BUF_HALL_RAW_FULL;
+    const int hi = BUF_HALL_RAW_EMPTY < BUF_HALL_RAW_FULL ? BUF_HALL_RAW_FULL : BUF_HALL_RAW_EMPTY;
+    if (raw < lo - BUF_HALL_FAULT_MARGIN || raw > hi + BUF_HALL_FAULT_MARGIN) return -1.0f;
+    float pct = (float)(raw - BUF_HALL_RAW_EMPTY) * 100.0f / (float)(BUF_HALL_RAW_FULL - BUF_HALL_RAW_EMPTY);
+    return pct < 0.0f ? 0.0f : (pct > 100.0f ? 100.0f : pct);
+}
+#endif
+
+// ----------------------- PIO edge counter -----------------------
+/*
+  Counts rising edges on a pin in the X register, up or down depending on
+  a second pin (jmp pin), and pushes X after every edge. The CPU drains the
+  RX FIFO and keeps the newest value, so reading costs nothing while idle.
+  Used for the printer's extruder STEP/DIR and single-channel pulse wheels.
+
+    0: wait 0 pin 0
+    1: wait 1 pin 0
+    2: jmp pin 6         ; direction high -> count up
+    3: jmp x-- 4         ; count down
+    4: mov isr, x
+    5: push noblock      ; wrap -> 0
+    6: mov x, ~x         ; x+1 == ~(~x - 1)
+    7: jmp x-- 8
+    8: mov x, ~x
+    9: jmp 4
+
+  Quadrature encoders get a 2x variant that counts both edges of A, with
+  B deciding the sign (A rising with B high, or falling with B low, is up).
+  An encoder resting on an A edge then dithers +1/-1 instead of piling up
+  counts one way; dither on a B edge doesn't count at all.
+
+     0: wait 1 pin 0      ; A rose
+     1: jmp pin 4         ; B high -> up
+     2: jmp x-- 3
+     3: jmp 7
+     4: mov x, ~x
+     5: jmp x-- 6
+     6: mov x, ~x
+     7: mov isr, x
+     8: push noblock
+     9: wait 0 pin 0      ; A fell
+    10: jmp pin 15        ; B high -> down
+    11: mov x, ~x
+    12: jmp x-- 13
+    13: mov x, ~x
+    14: jmp 16
+    15: jmp x-- 16
+    16: mov isr, x
+    17: push noblock      ; wrap -> 0
+*/
+
+typedef struct {
+    PIO pio;
+    uint sm;
+    bool ok;
+    uint32_t last;
+} pio_counter_t;
+
+#if USE_EXT_FOLLOWER || USE_FIL_ENCODER
+static uint16_t pio_counter_insn[10];
+static struct pio_program pio_counter_prog = {
+    .instructions = pio_counter_insn,
+    .length = 10,
+    .origin = -1,
+};
+static int pio_counter_offset[2] = { -1, -1 };
+
+static bool pio_counter_start(pio_counter_t *c, const struct pio_program *prog, int *prog_offset,
+                              uint wrap_top, uint pin_edge, uint pin_dir) {
+    c->ok = false;
+    for (int i = 0; i < 2 && !c->ok; i++) {
+        PIO pio = i ? pio1 : pio0;
+        int sm = pio_claim_unused_sm(pio, false);
+        if (sm < 0) continue;
+        if (prog_offset[i] < 0) {
+            if (!pio_can_add_program(pio, prog)) {
+                pio_sm_unclaim(pio, (uint)sm);
+                continue;
             }
+            prog_offset[i] = (int)pio_add_program(pio, prog);
+        }
+        c->pio = pio;
+        c->sm = (uint)sm;
+        c->ok = true;
+    }
+    if (!c->ok) return false;
+
+    gpio_init(pin_edge);
+    gpio_set_dir(pin_edge, GPIO_IN);
+    if (pin_dir != pin_edge) {
+        gpio_init(pin_dir);
+        gpio_set_dir(pin_dir, GPIO_IN);
+    }
+
+    uint offset = (uint)prog_offset[c->pio == pio1];
+    pio_sm_config cfg = pio_get_default_sm_config();
+    sm_config_set_wrap(&cfg, offset, offset + wrap_top);
+    sm_config_set_in_pins(&cfg, pin_edge);
+    sm_config_set_jmp_pin(&cfg, pin_dir);
+    sm_config_set_fifo_join(&cfg, PIO_FIFO_JOIN_RX);
+    pio_sm_init(c->pio, c->sm, offset, &cfg);
+    pio_sm_exec(c->pio, c->sm, pio_encode_mov(pio_x, pio_null));
+    pio_sm_set_enabled(c->pio, c->sm, true);
+
+    c->last = 0;
+    return true;
+}
+
+static bool pio_counter_init(pio_counter_t *c, uint pin_edge, uint pin_dir) {
+    pio_counter_insn[0] = pio_encode_wait_pin(false, 0);
+    pio_counter_insn[1] = pio_encode_wait_pin(true, 0);
+    pio_counter_insn[2] = pio_encode_jmp_pin(6);
+    pio_counter_insn[3] = pio_encode_jmp_x_dec(4);
+    pio_counter_insn[4] = pio_encode_mov(pio_isr, pio_x);
+    pio_counter_insn[5] = pio_encode_push(false, false);
+    pio_counter_insn[6] = pio_encode_mov_not(pio_x, pio_x);
+    pio_counter_insn[7] = pio_encode_jmp_x_dec(8);
+    pio_counter_insn[8] = pio_encode_mov_not(pio_x, pio_x);
+    pio_counter_insn[9] = pio_encode_jmp(4);
+    return pio_counter_start(c, &pio_counter_prog, pio_counter_offset, 5, pin_edge, pin_dir);
+}
+
+#if USE_FIL_ENCODER
+static uint16_t pio_quad_insn[18];
+static struct pio_program pio_quad_prog = {
+    .instructions = pio_quad_insn,
+    .length = 18,
+    .origin = -1,
+};
+static int pio_quad_offset[2] = { -1, -1 };
+
+static bool pio_quad_init(pio_counter_t *c, uint pin_a, uint pin_b) {
+    pio_quad_insn[0]  = pio_encode_wait_pin(true, 0);
+    pio_quad_insn[1]  = pio_encode_jmp_pin(4);
+    pio_quad_insn[2]  = pio_encode_jmp_x_dec(3);
+    pio_quad_insn[3]  = pio_encode_jmp(7);
+    pio_quad_insn[4]  = pio_encode_mov_not(pio_x, pio_x);
+    pio_quad_insn[5]  = pio_encode_jmp_x_dec(6);
+    pio_quad_insn[6]  = pio_encode_mov_not(pio_x, pio_x);
+    pio_quad_insn[7]  = pio_encode_mov(pio_isr, pio_x);
+    pio_quad_insn[8]  = pio_encode_push(false, false);
+    pio_quad_insn[9]  = pio_encode_wait_pin(false, 0);
+    pio_quad_insn[10] = pio_encode_jmp_pin(15);
+    pio_quad_insn[11] = pio_encode_mov_not(pio_x, pio_x);
+    pio_quad_insn[12] = pio_encode_jmp_x_dec(13);
+    pio_quad_insn[13] = pio_encode_mov_not(pio_x, pio_x);
+    pio_quad_insn[14] = pio_encode_jmp(16);
+    pio_quad_insn[15] = pio_encode_jmp_x_dec(16);
+    pio_quad_insn[16] = pio_encode_mov(pio_isr, pio_x);
+    pio_quad_insn[17] = pio_encode_push(false, false);
+    return pio_counter_start(c, &pio_quad_prog, pio_quad_offset, 17, pin_a, pin_b);
+}
+#endif
+#endif
+
+static inline int32_t pio_counter_read(pio_counter_t *c) {
+    while (!pio_sm_is_rx_fifo_empty(c->pio, c->sm)) c->last = pio_sm_get(c->pio, c->sm);
+    return (int32_t)c->last;
+}
+
+// ---------------------- Step pulse capture ----------------------
+/*
+  Diagnostic: a PIO state machine watches a lane's STEP pin (the input
+  side works whatever drives the pad, so no loopback wire) and measures
+  every high and low time in sys-clock cycles. DMA moves the counts into a
+  buffer; when it is full (or CAPTURE_TIMEOUT_MS passes) the SM and DMA
+  channel are released and capture_analyze() turns the words into rate
+  error, period jitter, minimum pulse width and minimum gap.
+
+    0: wait 0 pin 0
+    1: wait 1 pin 0          ; start on a rising edge
+    2: mov x, ~null          ; high: 2 cycles per count
+    3: jmp pin 5
+    4: jmp 6
+    5: jmp x-- 3
+    6: mov isr, ~x
+    7: push noblock
+    8: mov x, ~null          ; low: 2 cycles per count
+    9: jmp pin 11
+   10: jmp x-- 9
+   11: mov isr, ~x
+   12: push noblock          ; wrap -> 2
+
+  Words alternate high, low; high = 2n + 5 cycles, low = 2n + 4.
+  capture_analyze() only needs the words and the clock, no hardware.
+*/
+
+#define CAPTURE_MAX_WORDS   1024    // high/low pairs = half of this
+#define CAPTURE_TIMEOUT_MS  5000
+#define CAPTURE_HIST_BINS   6
+
+static const float capture_hist_us[CAPTURE_HIST_BINS - 1] = { 0.1f, 0.5f, 1.0f, 5.0f, 20.0f };
+
+typedef struct {
+    uint32_t periods;
+    float rate_sps;
+    float rate_err_pct;             // vs the expected rate (0 if none given)
+    float jitter_rms_us, jitter_max_us;
+    float high_min_us, low_min_us;
+    uint32_t hist[CAPTURE_HIST_BINS];   // |period - mean| in capture_hist_us bins
+} capture_stats_t;
+
+static bool capture_analyze(const uint32_t *w, uint32_t n, uint32_t clk_hz, float expect_sps,
+                            capture_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    uint32_t pairs = n / 2;
+    if (pairs < 2) return false;
+
+    const float us = 1e6f / (float)clk_hz;
+    double sum = 0.0;
+    st->high_min_us = st->low_min_us = 1e9f;
+    for (uint32_t i = 0; i < pairs; i++) {
+        float hi = (2.0f * w[2 * i] + 5.0f) * us;
+        float lo = (2.0f * w[2 * i + 1] + 4.0f) * us;
+        if (hi < st->high_min_us) st->high_min_us = hi;
+        if (lo < st->low_min_us) st->low_min_us = lo;
+        sum += hi + lo;
+    }
+    float mean = (float)(sum / pairs);
+    st->periods = pairs;
+    st->rate_sps = 1e6f / mean;
+    if (expect_sps > 0.0f) st->rate_err_pct = 100.0f * (st->rate_sps - expect_sps) / expect_sps;
+
+    double sq = 0.0;
+    for (uint32_t i = 0; i < pairs; i++) {
+        float p = (2.0f * (w[2 * i] + w[2 * i + 1]) + 9.0f) * us;
+        float d = fabsf(p - mean);
+        sq += (double)d * d;
+        if (d > st->jitter_max_us) st->jitter_max_us = d;
+        int b = 0;
+        while (b < CAPTURE_HIST_BINS - 1 && d >= capture_hist_us[b]) b++;
+        st->hist[b]++;
+    }
+    st->jitter_rms_us = sqrtf((float)(sq / pairs));
+    return true;
+}
+
+static uint16_t capture_insn[13];
+static struct pio_program capture_prog = {
+    .instructions = capture_insn,
+    .length = 13,
+    .origin = -1,
+};
+
+static struct {
+    bool busy;
+    int lane;
+    float expect_sps;
+    PIO pio;
+    uint sm, offset;
+    uint dma;
+    uint32_t words;
+    absolute_time_t deadline;
+    uint32_t buf[CAPTURE_MAX_WORDS];
+} cap;
+
+static bool capture_start(lane_t *L, int lane, int words) {
+    if (cap.busy) return false;
+    words = clamp_i(words, 4, CAPTURE_MAX_WORDS) & ~1;
+
+    capture_insn[0]  = pio_encode_wait_pin(false, 0);
+    capture_insn[1]  = pio_encode_wait_pin(true, 0);
+    capture_insn[2]  = pio_encode_mov_not(pio_x, pio_null);
+    capture_insn[3]  = pio_encode_jmp_pin(5);
+    capture_insn[4]  = pio_encode_jmp(6);
+    capture_insn[5]  = pio_encode_jmp_x_dec(3);
+    capture_insn[6]  = pio_encode_mov_not(pio_isr, pio_x);
+    capture_insn[7]  = pio_encode_push(false, false);
+    capture_insn[8]  = pio_encode_mov_not(pio_x, pio_null);
+    capture_insn[9]  = pio_encode_jmp_pin(11);
+    capture_insn[10] = pio_encode_jmp_x_dec(9);
+    capture_insn[11] = pio_encode_mov_not(pio_isr, pio_x);
+    capture_insn[12] = pio_encode_push(false, false);
+
+    bool ok = false;
+    for (int i = 0; i < 2 && !ok; i++) {
+        PIO pio = i ? pio1 : pio0;
+        if (!pio_can_add_program(pio, &capture_prog)) continue;
+        int sm = pio_claim_unused_sm(pio, false);
+        if (sm < 0) continue;
+        cap.pio = pio;
+        cap.sm = (uint)sm;
+        cap.offset = pio_add_program(pio, &capture_prog);
+        ok = true;
+    }
+    if (!ok) return false;
+    int dma = dma_claim_unused_channel(false);
+    if (dma < 0) {
+        pio_remove_program(cap.pio, &capture_prog, cap.offset);
+        pio_sm_unclaim(cap.pio, cap.sm);
+        return false;
+    }
+    cap.dma = (uint)dma;
+
+    pio_sm_config cfg = pio_get_default_sm_config();
+    sm_config_set_wrap(&cfg, cap.offset + 2, cap.offset + 12);
+    sm_config_set_in_pins(&cfg, L->m.step);
+    sm_config_set_jmp_pin(&cfg, L->m.step);
+    sm_config_set_fifo_join(&cfg, PIO_FIFO_JOIN_RX);
+    pio_sm_init(cap.pio, cap.sm, cap.offset, &cfg);
+
+    dma_channel_config c = dma_channel_get_default_config(cap.dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, pio_get_dreq(cap.pio, cap.sm, false));
+    dma_channel_configure(cap.dma, &c, cap.buf, &cap.pio->rxf[cap.sm], (uint)words, true);
+
+    cap.busy = true;
+    cap.lane = lane;
+    cap.words = (uint32_t)words;
+    cap.expect_sps = (L->mode != TASK_IDLE && L->backend != STEP_BACKEND_SEQ) ? (float)L->steps_per_sec : 0.0f;
+    cap.deadline = make_timeout_time_ms(CAPTURE_TIMEOUT_MS);
+    pio_sm_set_enabled(cap.pio, cap.sm, true);
+    printf("capture%d: %d edges%s\n", lane, words, cap.expect_sps > 0.0f ? "" : " (lane idle or ramping, no rate check)");
+    return true;
+}
+
+// Polled from the CLI task: report once the buffer is full or time is up
+static void capture_service(void) {
+    if (!cap.busy) return;
+    if (dma_channel_is_busy(cap.dma) && !time_reached(cap.deadline)) return;
+
+    pio_sm_set_enabled(cap.pio, cap.sm, false);
+    dma_channel_abort(cap.dma);
+    uint32_t got = cap.words - dma_channel_hw_addr(cap.dma)->transfer_count;
+    dma_channel_unclaim(cap.dma);
+    pio_remove_program(cap.pio, &capture_prog, cap.offset);
+    pio_sm_unclaim(cap.pio, cap.sm);
+    cap.busy = false;
+
+    capture_stats_t st;
+    if (!capture_analyze(cap.buf, got, clock_get_hz(clk_sys), cap.expect_sps, &st)) {
+        printf("capture%d: only %lu edges, is the lane stepping?\n", cap.lane, (unsigned long)got);
+        return;
+    }
+    printf("capture%d: %lu periods, rate %.1f sps", cap.lane, (unsigned long)st.periods, st.rate_sps);
+    if (cap.expect_sps > 0.0f) printf(" (set %.0f, err %+.3f%%)", cap.expect_sps, st.rate_err_pct);
+    printf("\ncapture%d: jitter rms %.3f us max %.3f us, min pulse %.3f us, min gap %.3f us\n",
+           cap.lane, st.jitter_rms_us, st.jitter_max_us, st.high_min_us, st.low_min_us);
+    printf("capture%d: |dev| <0.1us %lu  <0.5us %lu  <1us %lu  <5us %lu  <20us %lu  >=20us %lu\n", cap.lane,
+           (unsigned long)st.hist[0], (unsigned long)st.hist[1], (unsigned long)st.hist[2],
+           (unsigned long)st.hist[3], (unsigned long)st.hist[4], (unsigned long)st.hist[5]);
+}
+
+// ----------------------- Persistent store -----------------------
+/*
+  Settings journal in the last flash sector: each save programs the next
+  256-byte page, and only a full sector gets erased (~45 ms), so a save
+  is usually a single page program (<1 ms). Load takes the valid record
+  with the highest sequence number. Interrupts are off while flash is
+  busy, so stepping pauses: save only when the motors are idle.
+*/
+
+#define PERSIST_MAGIC   0x4E4F5750u     // "PWON"
+#define PERSIST_VERSION 2           // v2: active_lane
+#define PERSIST_OFFSET  (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define PERSIST_SLOTS   ((int)(FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE))
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t seq;
+    int32_t in_to_out[2];           // calibrated steps per lane (0 = unknown)
+    int32_t out_to_y[2];
+    uint32_t active_lane;           // lane feeding at the last save (1 or 2)
+    uint32_t crc;
+} persist_t;
+
+static persist_t persist;
+static int persist_slot = -1;       // last slot written (-1 = none)
+
+static uint32_t crc32_buf(const void *data, size_t n) {
+    const uint8_t *p = data;
+    uint32_t crc = 0xFFFFFFFFu;
+    while (n--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+    }
+    return ~crc;
+}
+
+static inline const persist_t *persist_slot_ptr(int slot) {
+    return (const persist_t *)(uintptr_t)(XIP_BASE + PERSIST_OFFSET + (uint32_t)slot * FLASH_PAGE_SIZE);
+}
+
+static inline bool persist_valid(const persist_t *p) {
+    if (p->magic != PERSIST_MAGIC) return false;
+    if (p->version == 1) {
+        // v1 ended after out_to_y: its crc sits where active_lane is now
+        return p->active_lane == crc32_buf(p, offsetof(persist_t, active_lane));
+    }
+    return p->version == PERSIST_VERSION && p->crc == crc32_buf(p, offsetof(persist_t, crc));
+}
+
+static bool persist_slot_erased(int slot) {
+    const uint32_t *w = (const uint32_t *)persist_slot_ptr(slot);
+    for (uint32_t i = 0; i < FLASH_PAGE_SIZE / 4; i++) {
+        if (w[i] != 0xFFFFFFFFu) return false;
+    }
+    return true;
+}
+
+static bool persist_load(void) {
+    memset(&persist, 0, sizeof(persist));
+    persist_slot = -1;
+    for (int i = 0; i < PERSIST_SLOTS; i++) {
+        const persist_t *p = persist_slot_ptr(i);
+        if (!persist_valid(p)) continue;
+        if (persist_slot < 0 || (int16_t)(p->seq - persist.seq) > 0) {
+            persist = *p;
+            persist_slot = i;
+        }
+    }
+    if (persist.active_lane != 1 && persist.active_lane != 2) persist.active_lane = 1;  // v1 record
+    return persist_slot >= 0;
+}
+
+static void wdt_kick(void);
+
+static void persist_save(void) {
+    persist.magic = PERSIST_MAGIC;
+    persist.version = PERSIST_VERSION;
+    persist.seq++;
+    persist.crc = crc32_buf(&persist, offsetof(persist_t, crc));
+
+    static uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, &persist, sizeof(persist));
+
+    // Skip pages left half-written by a power cut
+    int slot = persist_slot + 1;
+    while (slot < PERSIST_SLOTS && !persist_slot_erased(slot)) slot++;
+
+    // A full WDT_TIMEOUT_MS for the erase; the stall doesn't count as a slow loop
+    wdt_kick();
+    uint32_t irq = save_and_disable_interrupts();
+    if (slot >= PERSIST_SLOTS) {
+        flash_range_erase(PERSIST_OFFSET, FLASH_SECTOR_SIZE);
+        slot = 0;
+    }
+    flash_range_program(PERSIST_OFFSET + (uint32_t)slot * FLASH_PAGE_SIZE, page, FLASH_PAGE_SIZE);
+    restore_interrupts(irq);
+    wdt_kick();
+
+    persist_slot = slot;
+}
+
+// --------------------------- Watchdog ---------------------------
+/*
+  The main loop calls wdt_service() every pass. It feeds the hardware
+  watchdog only if the pass came round within WDT_LOOP_MAX_US and no
+  software-stepped lane is more than WDT_STEP_LATE_US behind; otherwise it
+  records why and lets the watchdog run out. A hang inside a task never
+  gets back to wdt_service(), so the scheduler also notes which task is
+  running. Scratch 4..7 belong to the SDK.
+
+    scratch0  WDT_MAGIC | reason
+    scratch1  last loop pass (us)
+    scratch2  longest loop pass since boot (us)
+    scratch3  scheduler task running (WDT_NO_TASK = none)
+*/
+
+#define WDT_MAGIC       0x57440000u     // "WD"
+#define WDT_NO_TASK     0xFFu
+
+typedef enum {
+    WDT_REASON_HANG = 0,            // fed normally until the loop stopped
+    WDT_REASON_LOOP_SLOW,
+    WDT_REASON_STEP_LATE,
+} wdt_reason_t;
+
+static struct {
+    bool fired;                     // last reset was our watchdog
+    uint32_t reason, loop_us, loop_max_us, task;
+} wdt_last;
+
+#if USE_WATCHDOG
+static uint32_t wdt_prev_us;
+#endif
+
+static const char *sched_task_name(uint32_t id);
+
+static inline void wdt_mark_task(uint32_t id) {
+#if USE_WATCHDOG
+    watchdog_hw->scratch[3] = id;
+#else
+    (void)id;
+#endif
+}
+
+// Call before anything else at boot: picks up what the previous run left
+static void wdt_boot_check(void) {
+    wdt_last.fired = watchdog_enable_caused_reboot() &&
+                     (watchdog_hw->scratch[0] & 0xFFFF0000u) == WDT_MAGIC;
+    if (wdt_last.fired) {
+        wdt_last.reason = watchdog_hw->scratch[0] & 0xFFFFu;
+        wdt_last.loop_us = watchdog_hw->scratch[1];
+        wdt_last.loop_max_us = watchdog_hw->scratch[2];
+        wdt_last.task = watchdog_hw->scratch[3];
+    }
+    for (int i = 0; i < 4; i++) watchdog_hw->scratch[i] = 0;
+}
+
+static void wdt_start(void) {
+#if USE_WATCHDOG
+    watchdog_hw->scratch[0] = WDT_MAGIC | WDT_REASON_HANG;
+    watchdog_hw->scratch[3] = WDT_NO_TASK;
+    wdt_prev_us = time_us_32();
+    watchdog_enable(WDT_TIMEOUT_MS, true);
+#endif
+}
+
+// Feed now and restart the loop timing, around a known long stall
+static void wdt_kick(void) {
+#if USE_WATCHDOG
+    watchdog_update();
+    wdt_prev_us = time_us_32();
+#endif
+}
+
+static inline uint32_t wdt_step_late_us(const lane_t *L, absolute_time_t now) {
+    if (L->mode == TASK_IDLE || L->backend != STEP_BACKEND_SW) return 0;
+    int64_t late = absolute_time_diff_us(L->next_step, now);
+    return late > 0 ? (uint32_t)late : 0;
+}
+
+static void wdt_service(const lane_t *a, const lane_t *b) {
+#if USE_WATCHDOG
+    uint32_t t = time_us_32();
+    uint32_t loop_us = t - wdt_prev_us;
+    wdt_prev_us = t;
+    watchdog_hw->scratch[1] = loop_us;
+    if (loop_us > watchdog_hw->scratch[2]) watchdog_hw->scratch[2] = loop_us;
+
+    absolute_time_t now = get_absolute_time();
+    uint32_t late = wdt_step_late_us(a, now);
+    uint32_t late_b = wdt_step_late_us(b, now);
+    if (late_b > late) late = late_b;
+
+    if (loop_us > WDT_LOOP_MAX_US) {
+        watchdog_hw->scratch[0] = WDT_MAGIC | WDT_REASON_LOOP_SLOW;
+    } else if (late > WDT_STEP_LATE_US) {
+        watchdog_hw->scratch[0] = WDT_MAGIC | WDT_REASON_STEP_LATE;
+    } else {
+        watchdog_hw->scratch[0] = WDT_MAGIC | WDT_REASON_HANG;
+        watchdog_update();
+    }
+#else
+    (void)a;
+    (void)b;
+#endif
+}
+
+static void wdt_report(void) {
+    static const char *const reasons[] = { "loop hung", "loop too slow", "step engine late" };
+    if (!wdt_last.fired) {
+        printf("wdt: last reset was not a watchdog reset\n");
+    } else {
+        printf("wdt: last reset by watchdog: %s, task=%s, last pass=%lu us, max pass=%lu us\n",
+               wdt_last.reason < 3 ? reasons[wdt_last.reason] : "?",
+               sched_task_name(wdt_last.task),
+               (unsigned long)wdt_last.loop_us, (unsigned long)wdt_last.loop_max_us);
+    }
+#if USE_WATCHDOG
+    printf("wdt: timeout=%d ms, max pass since boot=%lu us\n",
+           WDT_TIMEOUT_MS, (unsigned long)watchdog_hw->scratch[2]);
+#endif
+}
+
+// -------------------------- Scheduler ---------------------------
+/*
+  Static cooperative scheduler. Periodic tasks are released on a fixed grid
+  (release += period), so timing doesn't drift with loop jitter; the
+  deadline of a release is the next release. sched_run_one() runs at most
+  one due task (earliest deadline first) so the step path gets the CPU
+  between tasks. A release missed entirely is skipped and counted as an
+  overrun.
+*/
+
+typedef enum {
+    SCHED_INPUTS = 0,
+    SCHED_POLICY,
+    SCHED_POT,
+    SCHED_LED,
+    SCHED_CLI,
+    SCHED_FOLLOW,
+    SCHED_BUF,
+    SCHED_ENC,
+    SCHED_LINK,
+    SCHED_TELEMETRY,
+    SCHED_TASK_COUNT
+} sched_id_t;
+
+typedef void (*sched_fn_t)(absolute_time_t now);
+
+typedef struct {
+    const char *name;
+    sched_fn_t fn;
+    uint32_t period_us;             // 0 = on demand only
+    absolute_time_t release;        // next periodic release
+    bool pending;                   // on-demand trigger
+    absolute_time_t trig_at;
+
+    uint32_t runs, overruns;
+    uint32_t max_exec_us, max_late_us;
+} sched_task_t;
+
+static sched_task_t sched_tasks[SCHED_TASK_COUNT];
+
+static const char *sched_task_name(uint32_t id) {
+    if (id < SCHED_TASK_COUNT && sched_tasks[id].name) return sched_tasks[id].name;
+    return "none";
+}
+
+static void sched_add(sched_id_t id, const char *name, uint32_t period_us, sched_fn_t fn) {
+    sched_task_t *t = &sched_tasks[id];
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->fn = fn;
+    t->period_us = period_us;
+    t->release = get_absolute_time();
+}
+
+static inline void sched_trigger(sched_id_t id) {
+    sched_task_t *t = &sched_tasks[id];
+    if (!t->pending) {
+        t->pending = true;
+        t->trig_at = get_absolute_time();
+    }
+}
+
+#if USE_EVENTS
+// Change a periodic task's rate at run time (0 = on demand only)
+static void sched_set_period(sched_id_t id, uint32_t period_us) {
+    sched_task_t *t = &sched_tasks[id];
+    if (t->period_us == period_us) return;
+    if (t->period_us == 0) t->release = delayed_by_us(get_absolute_time(), period_us);
+    t->period_us = period_us;
+}
+#endif
+
+static bool sched_run_one(void) {
+    absolute_time_t now = get_absolute_time();
+
+    sched_task_t *best = NULL;
+    absolute_time_t best_rel = now, best_deadline = now;
+    bool best_periodic = false;
+
+    for (int i = 0; i < SCHED_TASK_COUNT; i++) {
+        sched_task_t *t = &sched_tasks[i];
+        if (!t->fn) continue;
+
+        bool periodic = t->period_us && time_reached(t->release);
+        if (!periodic && !t->pending) continue;
+
+        absolute_time_t rel = periodic ? t->release : t->trig_at;
+        absolute_time_t deadline = delayed_by_us(rel, t->period_us ? t->period_us : SCHED_ONDEMAND_DEADLINE_US);
+        if (!best || absolute_time_diff_us(deadline, best_deadline) > 0) {
+            best = t;
+            best_rel = rel;
+            best_deadline = deadline;
+            best_periodic = periodic;
+        }
+    }
+    if (!best) return false;
+
+    wdt_mark_task((uint32_t)(best - sched_tasks));
+    uint32_t t0 = time_us_32();
+    best->fn(now);
+    uint32_t exec = time_us_32() - t0;
+    wdt_mark_task(WDT_NO_TASK);
+    uint32_t late = (uint32_t)absolute_time_diff_us(best_rel, now);
+
+    best->runs++;
+    best->pending = false;
+    if (exec > best->max_exec_us) best->max_exec_us = exec;
+    if (late > best->max_late_us) best->max_late_us = late;
+    if (absolute_time_diff_us(best_deadline, get_absolute_time()) > 0) best->overruns++;
+
+    if (best_periodic) {
+        best->release = delayed_by_us(best->release, best->period_us);
+        int64_t behind = absolute_time_diff_us(best->release, get_absolute_time());
+        if (behind >= 0) {
+            uint32_t skip = (uint32_t)(behind / best->period_us) + 1;
+            best->release = delayed_by_us(best->release, (uint64_t)skip * best->period_us);
+            best->overruns += skip;
+        }
+    }
+    return true;
+}
+
+// Earliest periodic release, for sleeping between tasks
+static absolute_time_t sched_next_release(absolute_time_t cap) {
+    absolute_time_t t = cap;
+    for (int i = 0; i < SCHED_TASK_COUNT; i++) {
+        const sched_task_t *k = &sched_tasks[i];
+        if (!k->fn) continue;
+        if (k->pending) return get_absolute_time();
+        if (k->period_us && absolute_time_diff_us(k->release, t) > 0) t = k->release;
+    }
+    return t;
+}
+
+static void sched_report(void) {
+    for (int i = 0; i < SCHED_TASK_COUNT; i++) {
+        const sched_task_t *t = &sched_tasks[i];
+        if (!t->fn) continue;
+        printf("%-10s period=%luus runs=%lu overruns=%lu max_exec=%luus max_late=%luus\n",
+               t->name, (unsigned long)t->period_us, (unsigned long)t->runs,
+               (unsigned long)t->overruns, (unsigned long)t->max_exec_us, (unsigned long)t->max_late_us);
+    }
+}
+
+static void sched_reset_stats(void) {
+    for (int i = 0; i < SCHED_TASK_COUNT; i++) {
+        sched_task_t *t = &sched_tasks[i];
+        t->runs = t->overruns = t->max_exec_us = t->max_late_us = 0;
+    }
+}
+
+// --------------------------- USB CLI ----------------------------
+/*
+  Line commands over USB CDC:
+    tmc                       dump driver registers
+    tmc <1|2> run <mA>        run current
+    tmc <1|2> hold <mA>       hold current
+    tmc <1|2> spread <sps>    SpreadCycle above this rate (0 = off)
+    tmc <1|2> sgthrs <n>      StallGuard threshold (0 = off)
+    clear                     clear jam faults
+    cal                       show path-length calibration
+    cal <1|2>                 calibrate IN->OUT and OUT->Y-split
+    spool                     remaining filament and runout ETA
+    spool <1|2> <m>|<g>g      set what is left on a spool
+    status                    print telemetry now
+    sched [reset]             scheduler timing stats
+    stats [reset]             feed quality since last reset
+    set                       show runtime tunables
+    set low_delay <ms>        buffer LOW persistence before feeding
+    set feed <sps>            fixed feed rate (0 = pot)
+    sweep [s]                 simulated profiles x parameter grid, stats table
+    sweep stop                abort a running sweep
+    wdt                       last watchdog reset and loop latency
+    swaps                     swap phase timeline, min/mean/max
+    capture <1|2> [n]         measure n STEP edges of a lane and report timing
+    din [reset]               debounce profile and reaction latency per input
+    noise off|bounce|spike|motor|all   inject input noise (USE_DIN_NOISE builds)
+    enc                       filament encoder slip stats per lane
+    enc sim <1|2> <pct>|off   simulate the lane's encoder at a given slip
+    link                      board link status, remote lanes
+    link move <lane> <steps> <sps>   move a remote lane (negative = reverse)
+    link stop <lane>          stop a remote lane
+    T<n> | tool <n>           tool change to lane n; "tool" shows progress
+    events [reset]            event counts and the decision trace
+*/
+
+#define CLI_LINE_MAX  64
+
+static bool cal_start(int lane);
+static void cal_report(void);
+static void spool_report(void);
+static bool spool_set(int lane, const char *arg);
+static void fstats_report(void);
+static void swaplog_report(void);
+static void din_report(bool reset);
+static bool din_noise_set(const char *profile);
+static void fenc_report(void);
+static bool fenc_sim_set(int lane, const char *arg);
+static bool link_cli(int argc, char **argv);
+static bool tool_start(int lane);
+static bool tool_busy(void);
+static void ev_command(void);
+static void ev_report(bool reset);
+static void tool_report(void);
+static void fstats_reset(void);
+static void tune_report(void);
+static bool tune_set(const char *name, const char *val);
+static bool sweep_start(int run_s);
+static void sweep_stop(void);
+
+static char cli_line[CLI_LINE_MAX];
+static int  cli_len = 0;
+
+static void cli_tmc_dump(int lane, const tmc_t *t) {
+    uint32_t ifcnt = 0, gconf = 0, ihr = 0, chop = 0, drv = 0, tstep = 0, sg = 0;
+    bool rd = tmc_read(t->addr, TMC_REG_IFCNT, &ifcnt)
+           && tmc_read(t->addr, TMC_REG_GCONF, &gconf)
+           && tmc_read(t->addr, TMC_REG_IHOLD_IRUN, &ihr)
+           && tmc_read(t->addr, TMC_REG_CHOPCONF, &chop)
+           && tmc_read(t->addr, TMC_REG_DRV_STATUS, &drv)
+           && tmc_read(t->addr, TMC_REG_TSTEP, &tstep)
+           && tmc_read(t->addr, TMC_REG_SG_RESULT, &sg);
+    printf("tmc%d addr=%u ok=%d run=%dmA hold=%dmA ustep=%d spread=%d sgthrs=%d\n",
+           lane, t->addr, t->ok, t->run_ma, t->hold_ma, t->microsteps, t->spread_sps, t->sgthrs);
+    if (!rd) {
+        printf("tmc%d: no response\n", lane);
+        return;
+    }
+    printf("tmc%d ifcnt=%lu gconf=%08lx ihold_irun=%08lx chopconf=%08lx drv_status=%08lx tstep=%lu sg=%lu\n",
+           lane, (unsigned long)ifcnt, (unsigned long)gconf, (unsigned long)ihr,
+           (unsigned long)chop, (unsigned long)drv, (unsigned long)tstep, (unsigned long)sg);
+}
+
+static void cli_exec(char *line, lane_t *L1, lane_t *L2) {
+    char *argv[5] = {0};
+    int argc = 0;
+    for (char *tok = strtok(line, " \t"); tok && argc < 5; tok = strtok(NULL, " \t")) {
+        argv[argc++] = tok;
+    }
+    if (argc == 0) return;
+
+    if (strcmp(argv[0], "tmc") == 0) {
+        if (argc == 1) {
+            cli_tmc_dump(1, &L1->m.tmc);
+            cli_tmc_dump(2, &L2->m.tmc);
+            return;
+        }
+        if (argc != 4) goto usage;
+
+        int lane = atoi(argv[1]);
+        if (lane != 1 && lane != 2) goto usage;
+        lane_t *L = (lane == 1) ? L1 : L2;
+        tmc_t *t = &L->m.tmc;
+        int v = atoi(argv[3]);
+
+        if      (strcmp(argv[2], "run") == 0)    t->run_ma = clamp_i(v, 50, 2000);
+        else if (strcmp(argv[2], "hold") == 0)   t->hold_ma = clamp_i(v, 0, 2000);
+        else if (strcmp(argv[2], "spread") == 0) t->spread_sps = clamp_i(v, 0, 1000000);
+        else if (strcmp(argv[2], "sgthrs") == 0) t->sgthrs = clamp_i(v, 0, 255);
+        else goto usage;
+
+        printf("tmc%d: %s\n", lane, tmc_apply(t) ? "ok" : "write failed");
+        if (L->vel_sps != 0) lane_vactual_set(L, L->vel_sps);   // apply cleared VACTUAL
+        return;
+    }
+
+    if (strcmp(argv[0], "cal") == 0) {
+        if (argc == 1) cal_report();
+        else if (tool_busy() || !cal_start(atoi(argv[1]))) printf("cal: lane must be idle with filament at IN (and Y-split clear if active)\n");
+        return;
+    }
+
+    if (strcmp(argv[0], "spool") == 0) {
+        if (argc == 1) spool_report();
+        else if (argc != 3 || !spool_set(atoi(argv[1]), argv[2])) goto usage;
+        return;
+    }
+
+    if (strcmp(argv[0], "status") == 0) {
+        sched_trigger(SCHED_TELEMETRY);
+        return;
+    }
+
+    if (strcmp(argv[0], "sched") == 0) {
+        if (argc > 1 && strcmp(argv[1], "reset") == 0) sched_reset_stats();
+        else sched_report();
+        return;
+    }
+
+    if (strcmp(argv[0], "stats") == 0) {
+        if (argc > 1 && strcmp(argv[1], "reset") == 0) fstats_reset();
+        else fstats_report();
+        return;
+    }
+
+    if (strcmp(argv[0], "set") == 0) {
+        if (argc == 1) tune_report();
+        else if (argc != 3 || !tune_set(argv[1], argv[2])) goto usage;
+        return;
+    }
+
+    if (strcmp(argv[0], "sweep") == 0) {
+        if (argc > 1 && strcmp(argv[1], "stop") == 0) sweep_stop();
+        else if (!sweep_start(argc > 1 ? atoi(argv[1]) : 0)) printf("sweep: busy\n");
+        return;
+    }
+
+    if (strcmp(argv[0], "capture") == 0) {
+        int lane = argc > 1 ? atoi(argv[1]) : 0;
+        if (lane != 1 && lane != 2) goto usage;
+        if (!capture_start(lane == 1 ? L1 : L2, lane, argc > 2 ? atoi(argv[2]) : CAPTURE_MAX_WORDS)) {
+            printf("capture: busy or no free PIO/DMA\n");
+        }
+        return;
+    }
+
+    if (strcmp(argv[0], "din") == 0) {
+        din_report(argc > 1 && strcmp(argv[1], "reset") == 0);
+        return;
+    }
+
+    if (strcmp(argv[0], "noise") == 0) {
+        if (argc != 2 || !din_noise_set(argv[1])) goto usage;
+        return;
+    }
+
+    if (strcmp(argv[0], "enc") == 0) {
+        if (argc == 1) fenc_report();
+        else if (argc != 4 || strcmp(argv[1], "sim") != 0 || !fenc_sim_set(atoi(argv[2]), argv[3])) goto usage;
+        return;
+    }
+
+    if ((argv[0][0] == 'T' || argv[0][0] == 't') && argv[0][1] >= '0' && argv[0][1] <= '9' && argc == 1) {
+        if (!tool_start(atoi(argv[0] + 1))) printf("tool: refused\n");
+        return;
+    }
+    if (strcmp(argv[0], "tool") == 0) {
+        if (argc == 1) tool_report();
+        else if (argc != 2) goto usage;
+        else if (!tool_start(atoi(argv[1]))) printf("tool: refused\n");
+        return;
+    }
+
+    if (strcmp(argv[0], "events") == 0) {
+        ev_report(argc > 1 && strcmp(argv[1], "reset") == 0);
+        return;
+    }
+
+    if (strcmp(argv[0], "link") == 0) {
+        if (!link_cli(argc, argv)) goto usage;
+        return;
+    }
+
+    if (strcmp(argv[0], "swaps") == 0) {
+        swaplog_report();
+        return;
+    }
+
+    if (strcmp(argv[0], "wdt") == 0) {
+        wdt_report();
+        return;
+    }
+
+    if (strcmp(argv[0], "clear") == 0) {
+        L1->jammed = false;
+        L2->jammed = false;
+        printf("faults cleared\n");
+        return;
+    }
+
+usage:
+    printf("? tmc | tmc <1|2> run|hold|spread|sgthrs <v> | clear | cal [1|2] | spool [<1|2> <m>|<g>g] | status | sched [reset] | stats [reset] | set [low_delay|feed <v>] | wdt | swaps | capture <1|2> [n] | din [reset] | noise <profile> | enc [sim <1|2> <pct>|off] | link [move|stop <lane> ...] | T<n> | tool [<n>] | events [reset]\n");
+}
+
+static void cli_poll(lane_t *L1, lane_t *L2) {
+    int c;
+    while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
+        if (c == '\r' || c == '\n') {
+            cli_line[cli_len] = 0;
+            cli_len = 0;
+            cli_exec(cli_line, L1, L2);
+            ev_command();
+        } else if (cli_len < CLI_LINE_MAX - 1) {
+            cli_line[cli_len++] = (char)c;
+        }
+    }
+}
+
+// ---------------------------- MAIN -----------------------------
+
+static lane_t L1, L2;
+static din_t y_split, buf_low, buf_high;
+static din_t btn_rev_l1, btn_rev_l2;
+
+static int active_lane = 1;
+static bool swap_armed = false;
+static absolute_time_t swap_armed_at;
+static bool tail_tried = false;     // one active tail clear per swap
+static absolute_time_t low_since;
+static bool low_at_boot = true;     // LOW already asserted at reset: printer was drawing, feed now
+static bool low_seen = false;       // LOW edge already taken as low_since
+static bool persist_dirty = false;  // persist or active_lane changed, save once the motors are idle
+
+static int feed_sps = 5000;         // live feed rate from the pot
+
+static const struct { const char *name; din_t *d; } din_tab[] = {
+    { "l1_in", &L1.in_sw }, { "l1_out", &L1.out_sw },
+    { "l2_in", &L2.in_sw }, { "l2_out", &L2.out_sw },
+    { "buf_low", &buf_low }, { "buf_high", &buf_high }, { "y_split", &y_split },
+    { "rev_l1", &btn_rev_l1 }, { "rev_l2", &btn_rev_l2 },
+};
+#define DIN_COUNT  (sizeof(din_tab) / sizeof(din_tab[0]))
+
+// ---------------------------- Events ----------------------------
+/*
+  The policy acts on events: a debounced input changed, an alarm expired
+  (buffer LOW persistence), a feed rate source moved by more than
+  EVENT_RATE_DEADBAND_PCT, a lane stopped or finished a queued command, or
+  a command came in over USB. With USE_EVENTS it runs only then, plus a
+  supervision tick every EVENT_ACTIVE_TICK_MS while a lane moves or a swap
+  is pending (StallGuard, runout ETA); the inputs are sampled only from a
+  GPIO edge until they settle. Alarm callbacks post from interrupt context,
+  so the queue is guarded by masking interrupts. Each policy run drains the
+  queue, and every decision is traced with the event behind that run.
+*/
+
+typedef enum {
+    EV_INPUT = 1,                   // arg: din_tab index
+    EV_ALARM,                       // arg: ALARM_*
+    EV_RATE,                        // arg: RATE_*
+    EV_MOTION,                      // arg: lane
+    EV_CMD,
+    EV_TICK,
+    EV_TYPE_COUNT
+} ev_type_t;
+
+enum { ALARM_LOW_DELAY = 0, ALARM_COUNT };
+enum { RATE_POT = 0, RATE_BUF, RATE_FOLLOW };
+
+typedef enum {
+    EVD_AUTOLOAD = 0,
+    EVD_FEED_START,
+    EVD_FEED_STOP,
+    EVD_SWAP_ARM,
+    EVD_PRESTAGE,
+    EVD_TAIL,
+    EVD_SWAP,
+    EVD_MANUAL,
+    EVD_JAM
+} ev_decision_t;
+
+static const char *const ev_decision_name[] = {
+    "autoload", "feed start", "feed stop", "swap armed", "prestage", "tail clear", "swap", "manual", "jam",
+};
+
+#define EVQ_LEN  16
+
+typedef struct {
+    uint32_t t_us;                  // when it happened (input: raw edge)
+    uint8_t type, arg;
+} ev_t;
+
+typedef struct {
+    uint32_t t_us;
+    uint8_t what, lane;
+    ev_t cause;
+} ev_trace_t;
+
+static struct {
+    ev_t q[EVQ_LEN];
+    volatile uint8_t head, len;
+    uint32_t posted[EV_TYPE_COUNT], dropped;
+    uint32_t runs, lat_max_us;      // policy runs, event -> policy latency
+
+    ev_t cause;                     // behind the current policy run
+    alarm_id_t alarm[ALARM_COUNT];
+    absolute_time_t alarm_at[ALARM_COUNT];
+
+    int rate_last[3];
+    uint32_t lane_sig[2];           // mode and completion count seen by the step path
+
+    ev_trace_t trace[EVENT_TRACE_LEN];
+    uint8_t trace_head, trace_len;
+} ev;
+
+static void ev_post_at(uint8_t type, uint8_t arg, uint32_t t_us) {
+    uint32_t irq = save_and_disable_interrupts();
+    if (ev.len == EVQ_LEN) {
+        ev.dropped++;
+    } else {
+        ev.q[(ev.head + ev.len) % EVQ_LEN] = (ev_t){ t_us, type, arg };
+        ev.len++;
+        ev.posted[type]++;
+    }
+    restore_interrupts(irq);
+}
+
+static void ev_post(uint8_t type, uint8_t arg) {
+    ev_post_at(type, arg, time_us_32());
+}
+
+static void ev_command(void) {
+    ev_post(EV_CMD, 0);
+}
+
+static bool ev_pop(ev_t *e) {
+    uint32_t irq = save_and_disable_interrupts();
+    bool ok = ev.len > 0;
+    if (ok) {
+        *e = ev.q[ev.head];
+        ev.head = (uint8_t)((ev.head + 1) % EVQ_LEN);
+        ev.len--;
+    }
+    restore_interrupts(irq);
+    return ok;
+}
+
+#if USE_EVENTS
+static int64_t ev_alarm_fire(alarm_id_t id, void *user) {
+    (void)id;
+    int slot = (int)(intptr_t)user;
+    ev.alarm[slot] = 0;
+    ev_post(EV_ALARM, (uint8_t)slot);
+    return 0;
+}
+
+// Post EV_ALARM at `at` (re-arming only if the time changed)
+static void ev_alarm_set(int slot, absolute_time_t at) {
+    if (ev.alarm[slot] > 0 && absolute_time_diff_us(ev.alarm_at[slot], at) == 0) return;
+    if (ev.alarm[slot] > 0) cancel_alarm(ev.alarm[slot]);
+    ev.alarm_at[slot] = at;
+    ev.alarm[slot] = add_alarm_at(at, ev_alarm_fire, (void *)(intptr_t)slot, true);
+}
+
+static void ev_alarm_cancel(int slot) {
+    if (ev.alarm[slot] > 0) cancel_alarm(ev.alarm[slot]);
+    ev.alarm[slot] = 0;
+}
+#endif
+
+// Rate source moved enough to matter (starting and stopping always do)
+static void ev_rate(int src, int sps) {
+    int last = ev.rate_last[src];
+    int band = (abs(last) > abs(sps) ? abs(last) : abs(sps)) * EVENT_RATE_DEADBAND_PCT / 100;
+    if ((last == 0) == (sps == 0) && abs(sps - last) <= band) return;
+    ev.rate_last[src] = sps;
+    ev_post(EV_RATE, (uint8_t)src);
+}
+
+// Step path: a lane stopped, changed task or finished a queued command
+static inline void ev_watch_lane(const lane_t *L, int lane) {
+    uint32_t sig = (uint32_t)L->mode | ((uint32_t)L->md_len << 8) | ((uint32_t)L->event << 16);
+    if (sig == ev.lane_sig[lane - 1]) return;
+    ev.lane_sig[lane - 1] = sig;
+    ev_post(EV_MOTION, (uint8_t)lane);
+}
+
+// Start of a policy run: take what is queued; the last event is the cause
+static void ev_begin(void) {
+    uint32_t now = time_us_32();
+    ev.runs++;
+    ev_t e;
+    bool any = false;
+    while (ev_pop(&e)) {
+        uint32_t lat = now - e.t_us;
+        if (lat > ev.lat_max_us) ev.lat_max_us = lat;
+        ev.cause = e;
+        any = true;
+    }
+    if (!any) {
+        ev.cause = (ev_t){ now, EV_TICK, 0 };
+        ev.posted[EV_TICK]++;
+    }
+}
+
+static void ev_trace(ev_decision_t what, int lane) {
+    ev_trace_t *t = &ev.trace[(ev.trace_head + ev.trace_len) % EVENT_TRACE_LEN];
+    if (ev.trace_len == EVENT_TRACE_LEN) ev.trace_head = (uint8_t)((ev.trace_head + 1) % EVENT_TRACE_LEN);
+    else ev.trace_len++;
+    t->t_us = time_us_32();
+    t->what = (uint8_t)what;
+    t->lane = (uint8_t)lane;
+    t->cause = ev.cause;
+}
+
+// Main loop: turn interrupt-side flags into task triggers
+static inline void ev_dispatch(void) {
+#if USE_EVENTS
+    if (din_irq_pending) {
+        din_irq_pending = false;
+        sched_trigger(SCHED_INPUTS);
+    }
+#endif
+    if (ev.len) sched_trigger(SCHED_POLICY);
+}
+
+static void ev_cause_name(const ev_t *e, char *buf, size_t n) {
+    static const char *const rate[] = { "pot", "buf", "follow" };
+    switch (e->type) {
+        case EV_INPUT:  snprintf(buf, n, "input %s", din_tab[e->arg].name); break;
+        case EV_ALARM:  snprintf(buf, n, "alarm low_delay"); break;
+        case EV_RATE:   snprintf(buf, n, "rate %s", rate[e->arg % 3]); break;
+        case EV_MOTION: snprintf(buf, n, "lane%d motion", e->arg); break;
+        case EV_CMD:    snprintf(buf, n, "command"); break;
+        default:        snprintf(buf, n, "tick"); break;
+    }
+}
+
+static void ev_report(bool reset) {
+    if (reset) {
+        memset(ev.posted, 0, sizeof(ev.posted));
+        ev.dropped = ev.runs = ev.lat_max_us = 0;
+        ev.trace_len = 0;
+        return;
+    }
+    printf("events: %s policy runs=%lu input=%lu alarm=%lu rate=%lu motion=%lu cmd=%lu tick=%lu dropped=%lu lat_max=%luus\n",
+           USE_EVENTS ? "event-driven" : "polled", (unsigned long)ev.runs,
+           (unsigned long)ev.posted[EV_INPUT], (unsigned long)ev.posted[EV_ALARM], (unsigned long)ev.posted[EV_RATE],
+           (unsigned long)ev.posted[EV_MOTION], (unsigned long)ev.posted[EV_CMD], (unsigned long)ev.posted[EV_TICK],
+           (unsigned long)ev.dropped, (unsigned long)ev.lat_max_us);
+    for (int i = 0; i < ev.trace_len; i++) {
+        const ev_trace_t *t = &ev.trace[(ev.trace_head + i) % EVENT_TRACE_LEN];
+        char cause[24];
+        ev_cause_name(&t->cause, cause, sizeof(cause));
+        printf("  %10.3fs  %-10s lane%d  <- %s (+%luus)\n", t->t_us / 1e6, ev_decision_name[t->what], t->lane,
+               cause, (unsigned long)(t->t_us - t->cause.t_us));
+    }
+}
+
+
+// ------------------------ Feed statistics -----------------------
+/*
+  Running numbers for tuning: how long the buffer sat at LOW (the printer
+  is close to starving), how often feeding starts, motor duty and swap
+  latency. Change a tunable with "set", "stats reset", run a print, then
+  "stats" prints one table row per parameter set; "sweep" fills the same
+  table from simulated prints (see Feed sweep).
+*/
+
+static struct {
+    int low_delay_ms;               // LOW_DELAY_S at boot
+    int feed_sps;                   // fixed feed rate, 0 = pot
+} tune = { (int)(LOW_DELAY_S * 1000), 0 };
+
+typedef struct {
+    absolute_time_t since, last;
+    uint64_t total_us, low_us, high_us, feed_us;
+    uint32_t low_run_us, low_max_us; // current and longest LOW stretch
+    uint32_t feed_starts;
+    uint32_t swaps, swap_ms_sum, swap_ms_max;
+    bool low, high, feeding;        // state since the last sample
+    bool empty_known;               // buffer-empty time is modelled (sweep only)
+    uint64_t empty_us;
+    uint32_t empty_run_us, empty_max_us;
+} fstats_t;
+
+static fstats_t fstats;
+
+static void fstats_reset(void) {
+    memset(&fstats, 0, sizeof fstats);
+    fstats.since = fstats.last = get_absolute_time();
+}
+
+// The dt since the last sample counts for the state seen then: the policy
+// may only run when something changes
+static void fstats_add(fstats_t *f, uint32_t dt, bool low, bool high, bool feeding) {
+    f->total_us += dt;
+    if (f->low) {
+        f->low_us += dt;
+        f->low_run_us += dt;
+        if (f->low_run_us > f->low_max_us) f->low_max_us = f->low_run_us;
+    }
+    if (!low) f->low_run_us = 0;
+    if (f->high) f->high_us += dt;
+    if (f->feeding) f->feed_us += dt;
+    if (feeding && !f->feeding) f->feed_starts++;
+    f->low = low;
+    f->high = high;
+    f->feeding = feeding;
+}
+
+static void fstats_sample(absolute_time_t now, bool low, bool high, bool feeding) {
+    uint32_t dt = (uint32_t)absolute_time_diff_us(fstats.last, now);
+    fstats.last = now;
+    fstats_add(&fstats, dt, low, high, feeding);
+}
+
+// Time the buffer was drawn dry, i.e. the printer was starved
+static void fstats_add_empty(fstats_t *f, uint32_t dt, bool empty) {
+    if (!empty) {
+        f->empty_run_us = 0;
+        return;
+    }
+    f->empty_us += dt;
+    f->empty_run_us += dt;
+    if (f->empty_run_us > f->empty_max_us) f->empty_max_us = f->empty_run_us;
+}
+
+static void fstats_add_swap(fstats_t *f, uint32_t ms) {
+    f->swaps++;
+    f->swap_ms_sum += ms;
+    if (ms > f->swap_ms_max) f->swap_ms_max = ms;
+}
+
+static void fstats_swap(uint32_t ms) {
+    fstats_add_swap(&fstats, ms);
+}
+
+static void fstats_header(void) {
+    printf("profile   low_delay_ms feed_sps    run_s  empty%%  empty_max_ms  low%%  low_max_ms  high%%  starts  starts/min  duty%%  swaps  swap_avg_ms  swap_max_ms\n");
+}
+
+static void fstats_row(const char *profile, const fstats_t *f, int low_delay_ms, int feed_sps) {
+    float t = f->total_us / 1e6f;
+    if (t <= 0.0f) t = 1e-6f;
+    printf("%-9s %12d %8d %8.0f ", profile, low_delay_ms, feed_sps, t);
+    if (f->empty_known) printf("%6.1f %13lu ", 100.0f * f->empty_us / 1e6f / t, (unsigned long)(f->empty_max_us / 1000));
+    else printf("%6s %13s ", "-", "-");    // no sensor for it on the machine
+    printf("%5.1f %11lu %6.1f %7lu %11.1f %6.1f %6lu %12lu %12lu\n",
+           100.0f * f->low_us / 1e6f / t, (unsigned long)(f->low_max_us / 1000),
+           100.0f * f->high_us / 1e6f / t,
+           (unsigned long)f->feed_starts, f->feed_starts * 60.0f / t,
+           100.0f * f->feed_us / 1e6f / t,
+           (unsigned long)f->swaps,
+           (unsigned long)(f->swaps ? f->swap_ms_sum / f->swaps : 0),
+           (unsigned long)f->swap_ms_max);
+}
+
+static void fstats_report(void) {
+    if (boot_first_step_us) printf("boot: first step %lu us after reset\n", (unsigned long)boot_first_step_us);
+    fstats_header();
+    fstats_row("live", &fstats, tune.low_delay_ms, tune.feed_sps);
+}
+
+static void tune_report(void) {
+    printf("low_delay=%dms feed=%d%s\n", tune.low_delay_ms, tune.feed_sps, tune.feed_sps ? "" : " (pot)");
+}
+
+static bool tune_set(const char *name, const char *val) {
+    int v = atoi(val);
+    if (strcmp(name, "low_delay") == 0) tune.low_delay_ms = clamp_i(v, 0, 10000);
+    else if (strcmp(name, "feed") == 0) tune.feed_sps = v ? clamp_i(v, FEED_SPS_MIN, FEED_SPS_MAX) : 0;
+    else return false;
+    tune_report();
+    return true;
+}
+
+// -------------------------- Feed sweep --------------------------
+/*
+  Tuning without a printer: each extrusion profile is replayed against a
+  model of the buffer for every LOW delay / feed rate pair, and the result
+  goes into an fstats row like "stats" prints, plus the time the buffer ran
+  dry (printer starved), which only the model can see. The feed decision
+  follows task_policy (LOW held for the delay and HIGH open => feed at the
+  rate); the runout profile empties the active lane a third of the way in, its
+  tail has to clear the Y-split before the swap commits (as with
+  REQUIRE_Y_CLEAR_FOR_SWAP), and the pre-staged lane then closes its gap
+  before the buffer gets filament again. Hall/follower feed and motor
+  ramps are not modelled. Runs in slices from the CLI task, so the real
+  loop keeps going.
+*/
+#define SWEEP_TICK_MS       10      // policy tick while active (EVENT_ACTIVE_TICK_MS)
+#define SWEEP_SLICE_TICKS   200     // simulated ticks per CLI pass
+
+typedef enum {
+    SWEEP_CONSTANT = 0,
+    SWEEP_BURSTY,
+    SWEEP_RETRACT,
+    SWEEP_RUNOUT,
+    SWEEP_PROFILES
+} sweep_profile_t;
+
+static const char *const sweep_profile_name[SWEEP_PROFILES] = { "constant", "bursty", "retract", "runout" };
+static const int sweep_low_delay_ms[] = { 0, 200, 400, 1000, 2000 };
+static const int sweep_feed_sps[] = { 2000, 4000, 8000 };
+
+#define SWEEP_DELAYS  ((int)(sizeof sweep_low_delay_ms / sizeof sweep_low_delay_ms[0]))
+#define SWEEP_RATES   ((int)(sizeof sweep_feed_sps / sizeof sweep_feed_sps[0]))
+#define SWEEP_ROWS    (SWEEP_PROFILES * SWEEP_DELAYS * SWEEP_RATES)
+
+static struct {
+    bool busy;
+    uint32_t run_ms;
+    int row;
+    uint32_t t_ms;
+    float buf_mm;                   // buffer fill
+    bool low_seen;
+    uint32_t low_since_ms;
+    bool feeding;
+    bool ran_out, swap_armed;
+    uint32_t swap_armed_ms;
+    float tail_mm;                  // old tail still short of clearing the Y-split
+    float gap_mm;                   // new lane's tip still short of the old tail
+    fstats_t st;
+} sweep;
+
+// Filament drawn by the printer at t ms into the profile, mm/s
+static float sweep_extrude_mm_s(sweep_profile_t p, uint32_t t) {
+    switch (p) {
+    case SWEEP_BURSTY:
+        return (t % 7000) < 3000 ? 8.0f : 1.0f;     // sparse infill, then perimeters
+    case SWEEP_RETRACT: {
+        uint32_t ph = t % 2000;                     // 0.8 mm retract and prime every 2 s
+        if (ph < 2 * SWEEP_TICK_MS) return -40.0f;
+        if (ph < 4 * SWEEP_TICK_MS) return 40.0f;
+        return 2.0f;
+    }
+    default:
+        return 2.5f;
+    }
+}
+
+static void sweep_row_start(void) {
+    memset(&sweep.st, 0, sizeof sweep.st);
+    sweep.st.empty_known = true;
+    sweep.t_ms = 0;
+    sweep.buf_mm = (SWEEP_LOW_MM + SWEEP_HIGH_MM) / 2;
+    sweep.low_seen = false;
+    sweep.feeding = false;
+    sweep.ran_out = sweep.swap_armed = false;
+    sweep.tail_mm = sweep.gap_mm = 0.0f;
+}
+
+static void sweep_tick(sweep_profile_t p, int low_delay_ms, int feed_sps) {
+    uint32_t t = sweep.t_ms;
+    bool low = sweep.buf_mm < SWEEP_LOW_MM;
+    bool high = sweep.buf_mm > SWEEP_HIGH_MM;
+
+    // Same rule as task_policy: LOW must persist from its edge, HIGH wins
+    if (!low) sweep.low_seen = false;
+    else if (!sweep.low_seen) {
+        sweep.low_seen = true;
+        sweep.low_since_ms = t;
+    }
+    bool need_feed = low && !high && t - sweep.low_since_ms >= (uint32_t)low_delay_ms;
+
+    if (p == SWEEP_RUNOUT && !sweep.ran_out && t >= sweep.run_ms / 3) {
+        sweep.ran_out = sweep.swap_armed = true;
+        sweep.swap_armed_ms = t;
+        sweep.tail_mm = SWEEP_TAIL_MM;
+    }
+    if (sweep.swap_armed && sweep.tail_mm <= 0.0f) {
+        fstats_add_swap(&sweep.st, t - sweep.swap_armed_ms);
+        sweep.swap_armed = false;
+        sweep.gap_mm = SWAP_PRESTAGE_MARGIN_STEPS / LANE_STEPS_PER_MM;
+    }
+
+    fstats_add(&sweep.st, SWEEP_TICK_MS * 1000u, low, high, need_feed);
+    sweep.feeding = need_feed;
+
+    // Next tick: the lane pushes the tail through, then closes the gap, then fills
+    float dt = SWEEP_TICK_MS / 1000.0f;
+    float fed = sweep.feeding ? (float)feed_sps / LANE_STEPS_PER_MM * dt : 0.0f;
+    if (sweep.swap_armed) sweep.tail_mm -= fed;
+    float g = fed < sweep.gap_mm ? fed : sweep.gap_mm;
+    sweep.gap_mm -= g;
+    sweep.buf_mm += fed - g - sweep_extrude_mm_s(p, t) * dt;
+    if (sweep.buf_mm < 0.0f) sweep.buf_mm = 0.0f;
+    if (sweep.buf_mm > SWEEP_BUF_MM) sweep.buf_mm = SWEEP_BUF_MM;
+    fstats_add_empty(&sweep.st, SWEEP_TICK_MS * 1000u, sweep.buf_mm <= 0.0f);
+    sweep.t_ms = t + SWEEP_TICK_MS;
+}
+
+static void sweep_stop(void) {
+    if (sweep.busy) printf("sweep: stopped at row %d\n", sweep.row + 1);
+    sweep.busy = false;
+}
+
+static bool sweep_start(int run_s) {
+    if (sweep.busy) return false;
+    sweep.run_ms = (uint32_t)clamp_i(run_s > 0 ? run_s : SWEEP_RUN_S, 10, 3600) * 1000u;
+    sweep.row = 0;
+    sweep_row_start();
+    sweep.busy = true;
+    printf("sweep: %d rows of %lu s\n", SWEEP_ROWS, (unsigned long)(sweep.run_ms / 1000));
+    fstats_header();
+    return true;
+}
+
+static void sweep_service(void) {
+    if (!sweep.busy) return;
+    sweep_profile_t p = (sweep_profile_t)(sweep.row / (SWEEP_DELAYS * SWEEP_RATES));
+    int low_delay_ms = sweep_low_delay_ms[(sweep.row / SWEEP_RATES) % SWEEP_DELAYS];
+    int feed_sps = sweep_feed_sps[sweep.row % SWEEP_RATES];
+
+    for (int i = 0; i < SWEEP_SLICE_TICKS && sweep.t_ms < sweep.run_ms; i++) {
+        sweep_tick(p, low_delay_ms, feed_sps);
+    }
+    if (sweep.t_ms < sweep.run_ms) return;
+
+    fstats_row(sweep_profile_name[p], &sweep.st, low_delay_ms, feed_sps);
+    if (++sweep.row == SWEEP_ROWS) {
+        sweep.busy = false;
+        printf("sweep: done\n");
+        return;
+    }
+    sweep_row_start();
+}
+
+// ------------------------- Swap timeline ------------------------
+/*
+  Per swap, the time each phase was first reached, as offsets from the raw
+  IN edge of the outgoing lane (so debounce shows up in "armed"):
+    in_empty -> armed -> need_feed -> y_clear -> flip -> first step
+  Completed swaps go into a ring; "swaps" prints min/mean/max per phase.
+*/
+
+typedef enum {
+    SWP_IN_EMPTY = 0,
+    SWP_ARMED,
+    SWP_NEED_FEED,
+    SWP_Y_CLEAR,
+    SWP_FLIP,
+    SWP_FIRST_STEP,
+    SWP_COUNT
+} swap_phase_t;
+
+static const char *const swap_phase_names[SWP_COUNT] = {
+    "in_empty", "armed", "need_feed", "y_clear", "flip", "step",
+};
+
+typedef struct {
+    uint8_t from, to;
+    uint64_t t[SWP_COUNT];          // us since boot, 0 = not reached
+} swap_rec_t;
+
+static struct {
+    swap_rec_t ring[SWAP_LOG_LEN];
+    int head, count;
+    swap_rec_t cur;
+    bool open;
+} swaplog;
+
+static void swaplog_push(void) {
+    swaplog.ring[swaplog.head] = swaplog.cur;
+    swaplog.head = (swaplog.head + 1) % SWAP_LOG_LEN;
+    if (swaplog.count < SWAP_LOG_LEN) swaplog.count++;
+    swaplog.open = false;
+}
+
+static void swaplog_begin(int from, absolute_time_t in_edge, absolute_time_t armed) {
+    if (swaplog.open) swaplog_push();   // previous one never got its first step
+    memset(&swaplog.cur, 0, sizeof swaplog.cur);
+    swaplog.cur.from = (uint8_t)from;
+    swaplog.cur.to = (uint8_t)((from == 1) ? 2 : 1);
+    swaplog.cur.t[SWP_IN_EMPTY] = to_us_since_boot(in_edge);
+    swaplog.cur.t[SWP_ARMED] = to_us_since_boot(armed);
+    swaplog.open = true;
+}
+
+static inline void swaplog_mark(swap_phase_t p, absolute_time_t t) {
+    if (swaplog.open && !swaplog.cur.t[p]) swaplog.cur.t[p] = to_us_since_boot(t);
+}
+
+static inline void swaplog_first_step(absolute_time_t t) {
+    if (!swaplog.open || !swaplog.cur.t[SWP_FLIP]) return;
+    swaplog_mark(SWP_FIRST_STEP, t);
+    swaplog_push();
+}
+
+// Offset of a phase from in_empty in ms, or -1 if not reached
+static inline long swap_rec_ms(const swap_rec_t *r, int p) {
+    if (!r->t[p] || r->t[p] < r->t[SWP_IN_EMPTY]) return -1;
+    return (long)((r->t[p] - r->t[SWP_IN_EMPTY]) / 1000);
+}
+
+// in_empty -> first step of the last completed swap (ms, -1 = none yet)
+static long swaplog_last_total_ms(void) {
+    if (!swaplog.count) return -1;
+    return swap_rec_ms(&swaplog.ring[(swaplog.head + SWAP_LOG_LEN - 1) % SWAP_LOG_LEN], SWP_FIRST_STEP);
+}
+
+static void swaplog_report(void) {
+    if (!swaplog.count) {
+        printf("swaps: none yet\n");
+        return;
+    }
+    const swap_rec_t *last = &swaplog.ring[(swaplog.head + SWAP_LOG_LEN - 1) % SWAP_LOG_LEN];
+    printf("swaps: %d recorded, last lane%u -> lane%u (ms from in_empty)\n", swaplog.count, last->from, last->to);
+    printf("phase       last    min   mean    max\n");
+    for (int p = 1; p < SWP_COUNT; p++) {
+        long mn = -1, mx = -1, sum = 0;
+        int n = 0;
+        for (int i = 0; i < swaplog.count; i++) {
+            long v = swap_rec_ms(&swaplog.ring[i], p);
+            if (v < 0) continue;
+            if (mn < 0 || v < mn) mn = v;
+            if (v > mx) mx = v;
+            sum += v;
+            n++;
+        }
+        printf("%-9s %6ld %6ld %6ld %6ld\n", swap_phase_names[p],
+               swap_rec_ms(last, p), mn, n ? sum / n : -1L, mx);
+    }
+}
+
+// ----------------------- Extruder follower ----------------------
+/*
+  Position loop on the printer's extruder: every extruder step owes
+  LANE_STEPS_PER_MM / EXT_STEPS_PER_MM lane steps, and the lane runs at
+  owed / FOLLOW_LAG_MS. Retractions make owed negative, so the lane waits
+  until the extruder has advanced past them again. Buffer LOW adds a small
+  trim rate, buffer HIGH forgives anything owed.
+*/
+
+#if USE_EXT_FOLLOWER
+static struct {
+    pio_counter_t cnt;
+    int32_t last_count;
+    int lane;
+    int32_t last_lane_pos;
+    float owed;                     // lane steps still to feed
+    int sps;                        // rate the policy should feed at (0 = none)
+} follow;
+
+static void task_follow(absolute_time_t now) {
+    (void)now;
+    if (!follow.cnt.ok) return;
+
+    int32_t c = pio_counter_read(&follow.cnt);
+    int32_t d = c - follow.last_count;
+    follow.last_count = c;
+    if (EXT_DIR_INVERT) d = -d;
+    follow.owed += (float)d * (LANE_STEPS_PER_MM / EXT_STEPS_PER_MM);
+
+    lane_t *A = (active_lane == 1) ? &L1 : &L2;
+    int32_t pos = lane_position(A);
+    if (follow.lane != active_lane) {
+        follow.lane = active_lane;
+        follow.last_lane_pos = pos;
+    }
+    follow.owed -= (float)(pos - follow.last_lane_pos);
+    follow.last_lane_pos = pos;
+
+    if (active_low_on(&buf_low)) follow.owed += FOLLOW_TRIM_SPS * (FOLLOW_PERIOD_MS / 1000.0f);
+    if (active_low_on(&buf_high) && follow.owed > 0.0f) follow.owed = 0.0f;
+
+    int sps = follow.owed > 0.0f ? (int)(follow.owed * 1000.0f / FOLLOW_LAG_MS) : 0;
+    follow.sps = (sps < FOLLOW_MIN_SPS) ? 0 : clamp_i(sps, FOLLOW_MIN_SPS, FEED_SPS_MAX);
+    ev_rate(RATE_FOLLOW, follow.sps);
+}
+#endif
+
+// ----------------------- Filament encoder -----------------------
+/*
+  The drive gear's steps are compared with what the filament sensor saw,
+  window by window (ENC_WINDOW_MM of commanded motion, either direction).
+  A window ENC_SLIP_PCT short is reported once per slip episode; one
+  ENC_JAM_PCT short (ground-out filament, tangle) stops the lane and
+  latches the jam like StallGuard. Clean windows average into the lane's
+  distance scale. Steps and counts are compared with their signs, so
+  filament running backward against a forward command reads as a jam. A
+  pulse wheel has no direction; its counts take the commanded one. A lane
+  in "enc sim" mode derives its counts from its own steps at a set slip,
+  so the detection can be exercised without a sensor.
+*/
+
+#define ENC_MM_PER_EDGE  (ENC_MM_PER_COUNT / (ENC_QUADRATURE ? 2 : 1))
+
+typedef struct {
+    pio_counter_t cnt;
+    int32_t last_count;
+    int32_t last_pos;
+    int32_t win_steps;              // commanded this window, +forward
+    float win_mm;                   // measured this window, +forward
+    int sim_slip_pct;               // < 0 = real sensor
+    float sim_acc;                  // simulated counts not yet emitted
+    float slip_pct;                 // last window
+    float scale;                    // averaged commanded / measured
+    bool slipping;
+    uint32_t windows, slips, jams;
+} fil_enc_t;
+
+static fil_enc_t fenc[2] = {
+    { .sim_slip_pct = -1, .scale = 1.0f },
+    { .sim_slip_pct = -1, .scale = 1.0f },
+};
+
+#if USE_FIL_ENCODER
+static void fenc_init(void) {
+    const uint pins[2][2] = { { PIN_ENC1_A, PIN_ENC1_B }, { PIN_ENC2_A, PIN_ENC2_B } };
+    for (int i = 0; i < 2; i++) {
+        bool ok = ENC_QUADRATURE ? pio_quad_init(&fenc[i].cnt, pins[i][0], pins[i][1])
+                                 : pio_counter_init(&fenc[i].cnt, pins[i][0], pins[i][0]);
+        if (!ok) {
+            DBG_PRINTF("enc%d: no free PIO state machine\n", i + 1);
+        }
+    }
+}
+
+static void fenc_update(fil_enc_t *e, lane_t *L, int lane) {
+    (void)lane;                     // only used by DBG_PRINTF
+    int32_t pos = lane_position(L);
+    int32_t steps = pos - e->last_pos;
+    e->last_pos = pos;
+
+    int32_t counts;
+    if (e->sim_slip_pct >= 0) {
+        e->sim_acc += (float)steps * (float)(100 - e->sim_slip_pct) / 100.0f
+                      / (ENC_MM_PER_EDGE * LANE_STEPS_PER_MM);
+        counts = (int32_t)e->sim_acc;
+        e->sim_acc -= (float)counts;
+    } else if (e->cnt.ok) {
+        int32_t c = pio_counter_read(&e->cnt);
+        counts = c - e->last_count;
+        e->last_count = c;
+        if (!ENC_QUADRATURE && steps < 0) counts = -counts;
+        if (ENC_QUADRATURE && ENC_DIR_INVERT) counts = -counts;
+    } else {
+        return;
+    }
+
+    // Printer pulls while the lane is idle aren't ours to check
+    if (L->mode == TASK_IDLE && steps == 0) {
+        e->win_steps = 0;
+        e->win_mm = 0.0f;
+        return;
+    }
+
+    // A direction change starts a new window
+    if ((steps < 0 && e->win_steps > 0) || (steps > 0 && e->win_steps < 0)) {
+        e->win_steps = 0;
+        e->win_mm = 0.0f;
+    }
+    e->win_steps += steps;
+    e->win_mm += (float)counts * ENC_MM_PER_EDGE;
+    if ((float)abs(e->win_steps) < ENC_WINDOW_MM * LANE_STEPS_PER_MM) return;
+
+    float cmd_mm = (float)e->win_steps / LANE_STEPS_PER_MM;
+    float got_mm = e->win_mm;
+    e->win_steps = 0;
+    e->win_mm = 0.0f;
+    e->windows++;
+    e->slip_pct = 100.0f * (1.0f - got_mm / cmd_mm);
+
+    if (e->slip_pct >= ENC_JAM_PCT) {
+        e->jams++;
+        if (L->mode != TASK_IDLE) {
+            lane_stop_task(L);
+            L->jammed = true;
+            DBG_PRINTF("lane%d: filament not moving (%.0f%% short over %.0f mm), stopped\n",
+                       lane, e->slip_pct, fabsf(cmd_mm));
+        }
+        return;
+    }
+    if (e->slip_pct >= ENC_SLIP_PCT) {
+        if (!e->slipping) {
+            e->slips++;
+            DBG_PRINTF("lane%d: filament slipping, %.0f%% short over %.0f mm\n", lane, e->slip_pct, fabsf(cmd_mm));
+        }
+        e->slipping = true;
+        return;
+    }
+    e->slipping = false;
+
+    if (got_mm * cmd_mm > 0.0f) {
+        float r = cmd_mm / got_mm;
+        float lim = 1.0f + ENC_COMP_MAX_PCT / 100.0f;
+        if (r > lim) r = lim;
+        if (r < 1.0f / lim) r = 1.0f / lim;
+        e->scale += 0.25f * (r - e->scale);
+    }
+#if ENC_COMPENSATE
+    L->dist_scale = e->scale;
+#endif
+}
+
+static void task_enc(absolute_time_t now) {
+    (void)now;
+    fenc_update(&fenc[0], &L1, 1);
+    fenc_update(&fenc[1], &L2, 2);
+}
+#endif
+
+static void fenc_report(void) {
+    for (int i = 0; i < 2; i++) {
+        const fil_enc_t *e = &fenc[i];
+        const lane_t *L = i ? &L2 : &L1;
+        printf("enc%d src=%s windows=%lu last_slip=%.1f%% slips=%lu jams=%lu scale=%.3f%s\n",
+               i + 1, e->sim_slip_pct >= 0 ? "sim" : e->cnt.ok ? "pio" : "none",
+               (unsigned long)e->windows, e->slip_pct, (unsigned long)e->slips,
+               (unsigned long)e->jams, e->scale, L->dist_scale != 1.0f ? " (applied)" : "");
+    }
+}
+
+// "enc sim <lane> <slip%>" or "enc sim <lane> off"
+static bool fenc_sim_set(int lane, const char *arg) {
+    if (lane != 1 && lane != 2) return false;
+    fil_enc_t *e = &fenc[lane - 1];
+    if (strcmp(arg, "off") == 0) {
+        e->sim_slip_pct = -1;
+        if (e->cnt.ok) e->last_count = pio_counter_read(&e->cnt);
+    } else {
+        int pct = atoi(arg);
+        if (pct < 0 || pct > 100) return false;
+        e->sim_slip_pct = pct;
+        e->sim_acc = 0.0f;
+    }
+    e->win_steps = 0;
+    e->win_mm = 0.0f;
+    fenc_report();
+    return true;
+}
+
+// --------------------------- Board link ---------------------------
+/*
+  Two-wire bus on UART0 between ERB units. The coordinator's TX feeds every
+  lane server's RX; server TX lines join the coordinator's RX through a
+  diode each (wired-AND, 1k pull-up), so an idle server never fights the
+  one that is answering. The coordinator talks, a server only answers.
+
+    [A5] [addr] [type] [seq] [len] [payload 0..24] [crc16 lo] [crc16 hi]
+
+  addr has bit 7 set on replies; the CRC (CCITT, init 0xFFFF) covers addr
+  through payload. Every request is answered with STATUS, which is also the
+  ack: a request repeated with the same seq (reply lost) is answered again
+  but not executed twice. One exchange is in flight at a time; each server
+  is polled every LINK_POLL_MS and queued commands go out in between, so a
+  command reaches its server within LINK_SERVERS exchanges of
+  (LINK_RETRIES + 1) * LINK_REPLY_TIMEOUT_US. A server missing that many
+  replies in a row is offline; a server that hears nothing for
+  LINK_HEARTBEAT_MS stops its lanes.
+
+  Remote lanes are numbered after the local ones: server n has lanes
+  2n+1 and 2n+2. The policy and tool changes run on the local lanes only;
+  remote lanes take commands from "link move" / "link stop".
+*/
+#if LINK_ROLE
+
+#define LINK_SYNC             0xA5
+#define LINK_REPLY            0x80
+#define LINK_PAYLOAD_MAX      24
+#define LINK_FRAME_MAX        (5 + LINK_PAYLOAD_MAX + 2)  // fits the 32-byte UART TX FIFO
+#define LINK_TXQ_LEN          4
+#define LINK_OFFLINE_POLL_MS  500
+
+enum { LINK_POLL = 1, LINK_MOVE, LINK_STOP, LINK_STATUS = 0x10 };
+enum { LINK_UNTIL_NONE = 0, LINK_UNTIL_IN, LINK_UNTIL_OUT };
+
+// Per-lane status flags
+#define LINK_LF_IN      0x01
+#define LINK_LF_OUT     0x02
+#define LINK_LF_JAMMED  0x04
+#define LINK_LF_BUSY    0x08
+#define LINK_LF_MET     0x10        // last completion reached its condition
+
+typedef struct {
+    uint8_t buf[LINK_FRAME_MAX];
+    uint8_t n;
+} link_rx_t;
+
+typedef struct {
+    uint8_t type, len;
+    uint8_t p[LINK_PAYLOAD_MAX];
+} link_msg_t;
+
+typedef struct {
+    bool online;
+    uint8_t flags[2], mode[2], done_n[2], done_tag[2];
+    int32_t pos[2];
+    link_msg_t q[LINK_TXQ_LEN];
+    uint8_t q_head, q_len;
+    absolute_time_t next_poll;
+    uint32_t exchanges, timeouts, rejects;
+} link_peer_t;
+
+static struct {
+    link_rx_t rx;
+    uint32_t crc_errors;
+
+    // Coordinator
+    link_peer_t peer[LINK_SERVERS];
+    int cur;                        // server an exchange is open with (-1 = none)
+    int rr;
+    link_msg_t out;                 // request in flight
+    bool out_queued;                // ... taken from the server's queue
+    uint8_t seq, tries;
+    uint32_t sent_us, rtt_last_us, rtt_max_us;
+
+    // Lane server
+    bool heard_any;
+    absolute_time_t heard;
+    bool last_seq_valid;
+    uint8_t last_seq, last_ack;
+    uint8_t done_n[2], done_tag[2];
+    bool done_met[2];
+} link = { .cur = -1 };
+
+static uint16_t link_crc16(const uint8_t *d, int n) {
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < n; i++) {
+        crc ^= (uint16_t)(d[i] << 8);
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static inline void link_put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline uint32_t link_get32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void link_init(void) {
+    uart_init(uart0, LINK_BAUD);
+    uart_set_fifo_enabled(uart0, true);
+    gpio_set_function(PIN_LINK_TX, GPIO_FUNC_UART);
+    gpio_set_function(PIN_LINK_RX, GPIO_FUNC_UART);
+    gpio_pull_up(PIN_LINK_RX);
+}
+
+static void link_send(uint8_t addr, uint8_t type, uint8_t seq, const uint8_t *p, uint8_t len) {
+    uint8_t f[LINK_FRAME_MAX];
+    f[0] = LINK_SYNC;
+    f[1] = addr;
+    f[2] = type;
+    f[3] = seq;
+    f[4] = len;
+    memcpy(f + 5, p, len);
+    uint16_t crc = link_crc16(f + 1, 4 + len);
+    f[5 + len] = (uint8_t)crc;
+    f[6 + len] = (uint8_t)(crc >> 8);
+    uart_write_blocking(uart0, f, (size_t)(7 + len));
+}
+
+// Feeds one received byte; true when rx.buf holds a whole frame with a good CRC
+static bool link_rx_byte(link_rx_t *r, uint8_t b) {
+    if (r->n == 0 && b != LINK_SYNC) return false;
+    r->buf[r->n++] = b;
+    if (r->n < 5) return false;
+    uint8_t len = r->buf[4];
+    if (len > LINK_PAYLOAD_MAX) {
+        r->n = 0;
+        return false;
+    }
+    if (r->n < 7 + len) return false;
+    r->n = 0;
+    uint16_t crc = (uint16_t)(r->buf[5 + len] | (r->buf[6 + len] << 8));
+    if (crc != link_crc16(r->buf + 1, 4 + len)) {
+        link.crc_errors++;
+        return false;
+    }
+    return true;
+}
+
+// ---- Lane server ----
+
+static bool link_server_exec(uint8_t type, const uint8_t *p, uint8_t len) {
+    if (type == LINK_POLL) return true;
+    if (len < 1 || p[0] > 1) return false;
+    lane_t *L = p[0] ? &L2 : &L1;
+
+    if (type == LINK_MOVE && len >= 15) {
+        if (L->jammed || p[2] > TASK_TOOL) return false;
+        uint8_t until = (p[3] >> 2) & 3;
+        motion_cmd_t c = {
+            .kind = p[1] ? MC_RUN : MC_MOVE,
+            .mode = (task_mode_t)p[2],
+            .forward = p[3] & 1,
+            .until_on = (p[3] >> 1) & 1,
+            .until = until == LINK_UNTIL_IN ? &L->in_sw : until == LINK_UNTIL_OUT ? &L->out_sw : NULL,
+            .tag = p[4],
+            .sps = p[5] | (p[6] << 8),
+            .steps = (int32_t)link_get32(p + 7),
+            .accel = link_get32(p + 11),
+        };
+        return lane_motion_push(L, &c);
+    }
+    if (type == LINK_STOP && len >= 2) {
+        if (p[1]) lane_stop_decel(L);
+        else lane_stop_task(L);
+        return true;
+    }
+    return false;
+}
+
+static void link_server_status(uint8_t seq) {
+    uint8_t p[1 + 2 * 8];
+    p[0] = link.last_ack;
+    for (int i = 0; i < 2; i++) {
+        lane_t *L = i ? &L2 : &L1;
+        uint8_t *q = p + 1 + 8 * i;
+        q[0] = (uint8_t)((lane_in_present(L) ? LINK_LF_IN : 0) |
+                         (lane_out_present(L) ? LINK_LF_OUT : 0) |
+                         (L->jammed ? LINK_LF_JAMMED : 0) |
+                         ((L->mode != TASK_IDLE || lane_motion_busy(L)) ? LINK_LF_BUSY : 0) |
+                         (link.done_met[i] ? LINK_LF_MET : 0));
+        q[1] = (uint8_t)L->mode;
+        q[2] = link.done_n[i];
+        q[3] = link.done_tag[i];
+        link_put32(q + 4, (uint32_t)lane_position(L));
+    }
+    link_send(LINK_ADDR | LINK_REPLY, LINK_STATUS, seq, p, sizeof(p));
+}
+
+static void link_server_frame(const uint8_t *f) {
+    if (f[1] != LINK_ADDR) return;
+    if (!link.heard_any) DBG_PRINTF("link: coordinator online\n");
+    link.heard_any = true;
+    link.heard = get_absolute_time();
+
+    uint8_t seq = f[3];
+    if (!link.last_seq_valid || seq != link.last_seq) {
+        link.last_ack = link_server_exec(f[2], f + 5, f[4]);
+        link.last_seq = seq;
+        link.last_seq_valid = true;
+    }
+    link_server_status(seq);
+}
+
+static void link_server_service(void) {
+    for (int i = 0; i < 2; i++) {
+        lane_t *L = i ? &L2 : &L1;
+        motion_done_t d;
+        while (lane_motion_done(L, &d)) {
+            link.done_n[i]++;
+            link.done_tag[i] = d.tag;
+            link.done_met[i] = d.met;
+        }
+    }
+    if (link.heard_any && absolute_time_diff_us(link.heard, get_absolute_time()) > LINK_HEARTBEAT_MS * 1000) {
+        link.heard_any = false;
+        lane_stop_decel(&L1);
+        lane_stop_decel(&L2);
+        DBG_PRINTF("link: coordinator silent, lanes stopped\n");
+    }
+}
+
+// ---- Coordinator ----
+
+static void link_coord_send(void) {
+    link.sent_us = time_us_32();
+    link_send((uint8_t)(link.cur + 1), link.out.type, link.seq, link.out.p, link.out.len);
+}
+
+static void link_coord_reply(const uint8_t *f) {
+    if (link.cur < 0 || f[1] != ((link.cur + 1) | LINK_REPLY) || f[2] != LINK_STATUS || f[3] != link.seq) return;
+    if (f[4] < 1 + 2 * 8) return;
+    link_peer_t *pr = &link.peer[link.cur];
+    const uint8_t *p = f + 5;
+
+    link.rtt_last_us = time_us_32() - link.sent_us;
+    if (link.rtt_last_us > link.rtt_max_us) link.rtt_max_us = link.rtt_last_us;
+    pr->exchanges++;
+    if (!p[0] && link.out.type != LINK_POLL) pr->rejects++;
+    for (int i = 0; i < 2; i++) {
+        const uint8_t *q = p + 1 + 8 * i;
+        pr->flags[i] = q[0];
+        pr->mode[i] = q[1];
+        pr->done_n[i] = q[2];
+        pr->done_tag[i] = q[3];
+        pr->pos[i] = (int32_t)link_get32(q + 4);
+    }
+    if (!pr->online) DBG_PRINTF("link: server %d online\n", link.cur + 1);
+    pr->online = true;
+
+    if (link.out_queued) {
+        pr->q_head = (uint8_t)((pr->q_head + 1) % LINK_TXQ_LEN);
+        pr->q_len--;
+    }
+    link.cur = -1;
+}
+
+static void link_coord_service(void) {
+    if (link.cur >= 0) {
+        if (time_us_32() - link.sent_us < LINK_REPLY_TIMEOUT_US) return;
+        link_peer_t *pr = &link.peer[link.cur];
+        pr->timeouts++;
+        if (++link.tries <= LINK_RETRIES) {
+            link_coord_send();      // same seq: executed at most once
+            return;
+        }
+        if (pr->online) DBG_PRINTF("link: server %d offline\n", link.cur + 1);
+        pr->online = false;
+        pr->q_len = 0;              // commands for a lost server are void
+        link.cur = -1;
+    }
+
+    for (int k = 0; k < LINK_SERVERS; k++) {
+        int i = (link.rr + k) % LINK_SERVERS;
+        link_peer_t *pr = &link.peer[i];
+        if (pr->q_len == 0 && !time_reached(pr->next_poll)) continue;
+
+        link.out_queued = pr->q_len > 0;
+        if (link.out_queued) {
+            link.out = pr->q[pr->q_head];
+        } else {
+            link.out.type = LINK_POLL;
+            link.out.len = 0;
+        }
+        pr->next_poll = make_timeout_time_ms(pr->online ? LINK_POLL_MS : LINK_OFFLINE_POLL_MS);
+        link.cur = i;
+        link.rr = i + 1;
+        link.seq++;
+        link.tries = 0;
+        link_coord_send();
+        return;
+    }
+}
+
+// Remote lane (>= 3): its server, and the lane index on it
+static link_peer_t *link_lane(int lane, int *idx) {
+    int k = lane - 3;
+    if (LINK_ROLE != 1 || k < 0 || k / 2 >= LINK_SERVERS) return NULL;
+    *idx = k % 2;
+    return &link.peer[k / 2];
+}
+
+static bool link_lane_queue(link_peer_t *pr, const link_msg_t *m) {
+    if (!pr->online || pr->q_len == LINK_TXQ_LEN) return false;
+    pr->q[(pr->q_head + pr->q_len++) % LINK_TXQ_LEN] = *m;
+    return true;
+}
+
+// Queue a motion command on a remote lane; `until` is LINK_UNTIL_* (c->until is ignored)
+static bool link_lane_push(int lane, const motion_cmd_t *c, uint8_t until) {
+    int i;
+    link_peer_t *pr = link_lane(lane, &i);
+    if (!pr) return false;
+    int sps = clamp_i(c->sps, 0, 0xFFFF);
+    link_msg_t m = { .type = LINK_MOVE, .len = 15 };
+    m.p[0] = (uint8_t)i;
+    m.p[1] = c->kind == MC_RUN;
+    m.p[2] = (uint8_t)c->mode;
+    m.p[3] = (uint8_t)((c->forward ? 1 : 0) | (c->until_on ? 2 : 0) | (until << 2));
+    m.p[4] = c->tag;
+    m.p[5] = (uint8_t)sps;
+    m.p[6] = (uint8_t)(sps >> 8);
+    link_put32(m.p + 7, (uint32_t)c->steps);
+    link_put32(m.p + 11, c->accel);
+    return link_lane_queue(pr, &m);
+}
+
+static bool link_lane_stop(int lane, bool decel) {
+    int i;
+    link_peer_t *pr = link_lane(lane, &i);
+    if (!pr) return false;
+    link_msg_t m = { .type = LINK_STOP, .len = 2, .p = { (uint8_t)i, decel } };
+    return link_lane_queue(pr, &m);
+}
+
+static void task_link(absolute_time_t now) {
+    (void)now;
+    if (LINK_ROLE == 2) link_server_service();
+    while (uart_is_readable(uart0)) {
+        if (!link_rx_byte(&link.rx, (uint8_t)uart_getc(uart0))) continue;
+        if (LINK_ROLE == 2) link_server_frame(link.rx.buf);
+        else link_coord_reply(link.rx.buf);
+    }
+    if (LINK_ROLE == 1) link_coord_service();
+}
+
+static void link_report(void) {
+    if (LINK_ROLE == 2) {
+        printf("link server addr=%d coordinator=%s crc_err=%lu\n", LINK_ADDR,
+               link.heard_any ? "heard" : "silent", (unsigned long)link.crc_errors);
+        return;
+    }
+    printf("link coordinator rtt last=%luus max=%luus crc_err=%lu\n",
+           (unsigned long)link.rtt_last_us, (unsigned long)link.rtt_max_us, (unsigned long)link.crc_errors);
+    for (int s = 0; s < LINK_SERVERS; s++) {
+        const link_peer_t *pr = &link.peer[s];
+        printf("srv%d online=%d exchanges=%lu timeouts=%lu rejects=%lu queued=%u\n", s + 1, pr->online,
+               (unsigned long)pr->exchanges, (unsigned long)pr->timeouts, (unsigned long)pr->rejects, pr->q_len);
+        for (int i = 0; i < 2; i++) {
+            uint8_t f = pr->flags[i];
+            printf("  lane%d in=%d out=%d busy=%d jam=%d mode=%d pos=%ld done=%u tag=%u met=%d\n", 2 * (s + 1) + 1 + i,
+                   !!(f & LINK_LF_IN), !!(f & LINK_LF_OUT), !!(f & LINK_LF_BUSY), !!(f & LINK_LF_JAMMED),
+                   pr->mode[i], (long)pr->pos[i], pr->done_n[i], pr->done_tag[i], !!(f & LINK_LF_MET));
+        }
+    }
+}
+
+// "link move <lane> <steps> <sps>" (negative steps = reverse) / "link stop <lane>"
+static bool link_cli(int argc, char **argv) {
+    if (argc == 1) {
+        link_report();
+        return true;
+    }
+    int lane = argc >= 3 ? atoi(argv[2]) : 0;
+    if (strcmp(argv[1], "stop") == 0 && argc == 3) return link_lane_stop(lane, true);
+    if (strcmp(argv[1], "move") == 0 && argc == 5) {
+        int32_t steps = atoi(argv[3]);
+        motion_cmd_t c = {
+            .kind = MC_MOVE, .mode = TASK_MANUAL, .sps = atoi(argv[4]),
+            .forward = steps >= 0, .steps = steps >= 0 ? steps : -steps,
+        };
+        return c.steps > 0 && c.sps > 0 && link_lane_push(lane, &c, LINK_UNTIL_NONE);
+    }
+    return false;
+}
+#else
+static bool link_cli(int argc, char **argv) {
+    (void)argc; (void)argv;
+    printf("link: off (LINK_ROLE 0)\n");
+    return true;
+}
+#endif
+
+// ----------------------- Buffer PI control -----------------------
+/*
+  Feed rate = Kp * (setpoint - fill) + integral, limited to the pot rate.
+  The integral only accumulates while the output is not saturated, and the
+  switches override: LOW forces the pot rate, HIGH forces zero and drains
+  any positive integral. A sensor fault falls back to the switch logic.
+*/
+
+static struct {
+    bool ok;
+    float pct;                      // filtered fill, 0..100
+    float integ;                    // sps
+    int sps;                        // rate the policy should feed at (0 = none)
+} bufpi;
+
+#if USE_BUF_HALL
+static void task_buf(absolute_time_t now) {
+    (void)now;
+    float pct = buf_hall_read_pct();
+    if (pct < 0.0f) {
+        if (bufpi.ok) DBG_PRINTF("buffer: hall sensor fault, using switches\n");
+        bufpi.ok = false;
+        bufpi.integ = 0.0f;
+        bufpi.sps = 0;
+        ev_rate(RATE_BUF, 0);
+        return;
+    }
+    if (!bufpi.ok) bufpi.pct = pct;
+    bufpi.ok = true;
+    bufpi.pct += 0.3f * (pct - bufpi.pct);
+
+    const float dt = BUF_PERIOD_MS / 1000.0f;
+    float err = BUF_SETPOINT_PCT - bufpi.pct;
+    float out = BUF_PI_KP * err + bufpi.integ;
+    if ((out < (float)feed_sps || err < 0.0f) && (out > 0.0f || err > 0.0f)) {
+        bufpi.integ += BUF_PI_KI * err * dt;
+        out = BUF_PI_KP * err + bufpi.integ;
+    }
+
+    if (active_low_on(&buf_low)) out = (float)feed_sps;
+    if (active_low_on(&buf_high)) {
+        out = 0.0f;
+        if (bufpi.integ > 0.0f) bufpi.integ = 0.0f;
+    }
+
+    int sps = (int)out;
+    bufpi.sps = (sps < BUF_PI_MIN_SPS) ? 0 : clamp_i(sps, BUF_PI_MIN_SPS, feed_sps);
+    ev_rate(RATE_BUF, bufpi.sps);
+}
+#endif
+
+// ------------------------- Calibration --------------------------
+/*
+  cal <lane>: back the filament off until IN clears, then measure in steps
+  IN->OUT and (if the Y-split is free) OUT->Y-split, park at OUT again and
+  store the result. The whole sequence is queued up front as RUN-until
+  commands, so every edge ends its command in the step path and the next
+  one starts without a gap; the policy only reads the completions. Both
+  edges of a measurement go through the same debounce, which cancels out.
+*/
+
+typedef enum {
+    CAL_IDLE = 0,
+    CAL_BACK_TO_IN,
+    CAL_FIND_IN,
+    CAL_TO_OUT,
+    CAL_TO_Y,
+    CAL_PARK_BACK,
+    CAL_PARK_FWD
+} cal_state_t;
+
+static struct {
+    cal_state_t state;
+    int lane;
+    lane_t *L;
+    bool y_busy;                    // Y-split held by the other lane: keep the old OUT->Y
+    int32_t mark;
+    int32_t in_out, out_y;
+} cal;
+
+static bool cal_queue(lane_t *L, cal_state_t tag, bool forward, const din_t *until, bool until_on) {
+    motion_cmd_t c = {
+        .kind = MC_RUN, .mode = TASK_CAL, .sps = CAL_SPS, .forward = forward,
+        .steps = CAL_MAX_STEPS, .until = until, .until_on = until_on, .tag = (uint8_t)tag,
+    };
+    return lane_motion_push(L, &c);
+}
+
+static bool cal_start(int lane) {
+    if (cal.state != CAL_IDLE || (lane != 1 && lane != 2)) return false;
+    lane_t *L = (lane == 1) ? &L1 : &L2;
+    if (L->mode != TASK_IDLE || L->jammed || !lane_in_present(L)) return false;
+    if (lane == active_lane && active_low_on(&y_split)) return false;
+
+    motion_done_t d;
+    while (lane_motion_done(L, &d)) {}      // not ours
+
+    cal.lane = lane;
+    cal.L = L;
+    cal.in_out = L->cal_in_out;
+    cal.out_y = L->cal_out_y;
+    cal.y_busy = false;
+    cal.state = CAL_BACK_TO_IN;
+    cal_queue(L, CAL_BACK_TO_IN, false, &L->in_sw,  false);
+    cal_queue(L, CAL_FIND_IN,    true,  &L->in_sw,  true);
+    cal_queue(L, CAL_TO_OUT,     true,  &L->out_sw, true);
+    cal_queue(L, CAL_TO_Y,       true,  &y_split,   true);
+    cal_queue(L, CAL_PARK_BACK,  false, &L->out_sw, false);
+    cal_queue(L, CAL_PARK_FWD,   true,  &L->out_sw, true);
+    printf("cal%d: started\n", lane);
+    return true;
+}
+
+static void cal_finish(bool ok) {
+    lane_t *L = cal.L;
+    if (lane_motion_busy(L)) lane_stop_task(L);
+    cal.state = CAL_IDLE;
+    if (!ok) {
+        printf("cal%d: failed\n", cal.lane);
+        return;
+    }
+
+    L->cal_in_out = cal.in_out;
+    L->cal_out_y = cal.out_y;
+    persist.in_to_out[cal.lane - 1] = cal.in_out;
+    persist.out_to_y[cal.lane - 1] = cal.out_y;
+    persist_dirty = true;           // the other lane may still be moving
+    printf("cal%d: in->out=%ld out->y=%ld steps, saved when idle\n", cal.lane, (long)cal.in_out, (long)cal.out_y);
+}
+
+static void cal_service(bool y_present) {
+    if (cal.state == CAL_IDLE) return;
+    lane_t *L = cal.L;
+
+    motion_done_t d;
+    while (lane_motion_done(L, &d)) {
+        // Move budget ran out or the lane got stopped: give up
+        if (!d.met) {
+            cal_finish(false);
+            return;
+        }
+        cal.state = (cal_state_t)(d.tag + 1);
+        switch ((cal_state_t)d.tag) {
+            case CAL_FIND_IN:
+                cal.mark = d.pos;
+                break;
+            case CAL_TO_OUT:
+                cal.in_out = d.pos - cal.mark;
+                cal.mark = d.pos;
+                cal.y_busy = y_present;
+                break;
+            case CAL_TO_Y:
+                if (!cal.y_busy) cal.out_y = d.pos - cal.mark;
+                break;
+            case CAL_PARK_FWD:
+                cal_finish(true);
+                return;
+            default:
+                break;
+        }
+    }
+
+    if (!lane_motion_busy(L)) cal_finish(false);
+}
+
+static void cal_report(void) {
+    printf("cal1: in->out=%ld out->y=%ld  cal2: in->out=%ld out->y=%ld steps\n",
+           (long)L1.cal_in_out, (long)L1.cal_out_y, (long)L2.cal_in_out, (long)L2.cal_out_y);
+}
+
+// -------------------------- Tool change -------------------------
+/*
+  T<n> / tool <n>: make lane n the active lane on purpose. The active lane
+  retracts at speed until the Y-split clears, then parks at OUT (back past
+  it, forward onto it). The target pre-advances toward the Y-split at the
+  same time, and once the Y-split is clear runs on until it reads filament
+  again (plus TOOL_READY_STEPS). Long moves are RUN-until commands with a
+  distance budget, so they ramp on the step sequencer. The fast ones ramp
+  down from the Y-split edge and end a ramp's length past it; the slow
+  park moves stop on the OUT edge. The printer must have pulled the filament out of its
+  extruder before sending the command.
+*/
+
+typedef enum {
+    TC_OLD_CLEAR_Y = 1,
+    TC_OLD_PAST_OUT,
+    TC_OLD_PARK,
+    TC_NEW_PRESTAGE,
+    TC_NEW_TO_Y,
+    TC_NEW_READY
+} tool_tag_t;
+
+static struct {
+    bool busy;
+    int from, to;
+    lane_t *O, *N;                  // old and new lane
+    bool old_done, new_done, y_clear;
+    absolute_time_t t0;
+    uint32_t clear_ms;              // Y-split free after this long
+} tool;
+
+static bool tool_queue(lane_t *L, tool_tag_t tag, motion_kind_t kind, int sps, bool forward,
+                       int32_t steps, const din_t *until, bool until_on, bool decel) {
+    motion_cmd_t c = {
+        .kind = kind, .mode = TASK_TOOL, .sps = sps, .forward = forward,
+        .steps = steps, .until = until, .until_on = until_on, .decel = decel, .tag = (uint8_t)tag,
+    };
+    return lane_motion_push(L, &c);
+}
+
+static void tool_finish(const char *fail) {
+    if (lane_motion_busy(tool.O)) lane_stop_task(tool.O);
+    if (lane_motion_busy(tool.N)) lane_stop_task(tool.N);
+    tool.busy = false;
+    uint32_t ms = (uint32_t)(absolute_time_diff_us(tool.t0, get_absolute_time()) / 1000);
+    if (fail) {
+        printf("tool: T%d failed (%s) after %lu ms\n", tool.to, fail, (unsigned long)ms);
+        return;
+    }
+
+    active_lane = tool.to;
+    persist_dirty = true;
+    swap_armed = false;
+    tail_tried = false;
+    tool.N->staged = false;
+    printf("tool: T%d ok in %lu ms (y-split clear after %lu ms)\n", tool.to, (unsigned long)ms,
+           (unsigned long)tool.clear_ms);
+}
+
+static bool tool_start(int lane) {
+    if (tool.busy || cal.state != CAL_IDLE) return false;
+    if (LINK_ROLE == 2) {
+        printf("tool: lane server, tool changes run on the coordinator\n");
+        return false;
+    }
+    if (lane != 1 && lane != 2) {
+        printf("tool: T%d is not a local lane\n", lane);
+        return false;
+    }
+    if (lane == active_lane) {
+        printf("tool: T%d ok in 0 ms (already active)\n", lane);
+        return true;
+    }
+    lane_t *O = (active_lane == 1) ? &L1 : &L2;
+    lane_t *N = (lane == 1) ? &L1 : &L2;
+    if (N->jammed || O->jammed || !lane_out_present(N)) return false;
+    if (N->mode != TASK_IDLE && N->mode != TASK_PRESTAGE) return false;
+
+    if (O->mode != TASK_IDLE) lane_stop_task(O);
+    if (N->mode != TASK_IDLE) lane_stop_task(N);
+    motion_done_t d;
+    while (lane_motion_done(O, &d) || lane_motion_done(N, &d)) {}   // not ours
+
+    tool.busy = true;
+    tool.from = active_lane;
+    tool.to = lane;
+    tool.O = O;
+    tool.N = N;
+    tool.t0 = get_absolute_time();
+    tool.clear_ms = 0;
+    tool.y_clear = false;
+
+    tool_queue(O, TC_OLD_CLEAR_Y, MC_RUN, TOOL_SPS, false, TOOL_UNLOAD_MAX_STEPS, &y_split, false, true);
+    tool.old_done = !lane_out_present(O);   // nothing to park
+    if (!tool.old_done) {
+        tool_queue(O, TC_OLD_PAST_OUT, MC_RUN, TOOL_PARK_SPS, false, CAL_MAX_STEPS, &O->out_sw, false, false);
+        tool_queue(O, TC_OLD_PARK,     MC_RUN, TOOL_PARK_SPS, true,  CAL_MAX_STEPS, &O->out_sw, true, false);
+    }
+
+    tool.new_done = false;
+    int32_t pre = N->staged ? 0 : lane_prestage_steps(N);
+    if (pre > 0) tool_queue(N, TC_NEW_PRESTAGE, MC_MOVE, TOOL_SPS, true, pre, NULL, false, false);
+    N->staged = false;
+
+    printf("tool: T%d from T%d\n", lane, tool.from);
+    return true;
+}
+
+static void tool_service(absolute_time_t now) {
+    if (!tool.busy) return;
+    motion_done_t d;
+
+    while (lane_motion_done(tool.O, &d)) {
+        if (!d.met) {
+            tool_finish(d.tag == TC_OLD_CLEAR_Y ? "y-split not clearing" : "park");
+            return;
+        }
+        if (d.tag == TC_OLD_CLEAR_Y) {
+            tool.clear_ms = (uint32_t)(absolute_time_diff_us(tool.t0, now) / 1000);
+            tool.y_clear = true;
+            lane_t *N = tool.N;
+            int32_t budget = N->cal_out_y > 0 ? N->cal_out_y + (N->cal_out_y * AUTOLOAD_MARGIN_PCT) / 100
+                                              : TOOL_LOAD_MAX_STEPS;
+            tool_queue(N, TC_NEW_TO_Y, MC_RUN, TOOL_SPS, true, budget, &y_split, true, true);
+            if (TOOL_READY_STEPS > 0) tool_queue(N, TC_NEW_READY, MC_MOVE, TOOL_PARK_SPS, true, TOOL_READY_STEPS, NULL, false, false);
+        }
+        if (d.tag == TC_OLD_PARK) tool.old_done = true;
+    }
+
+    while (lane_motion_done(tool.N, &d)) {
+        if (!d.met) {
+            tool_finish("load");
+            return;
+        }
+        if (d.tag == (TOOL_READY_STEPS > 0 ? TC_NEW_READY : TC_NEW_TO_Y)) tool.new_done = true;
+    }
+
+    if (tool.old_done && tool.new_done) {
+        tool_finish(NULL);
+        return;
+    }
+    // Stopped from outside (jam, manual)
+    if (!lane_motion_busy(tool.O) && !tool.old_done) tool_finish("unload stopped");
+    else if (!lane_motion_busy(tool.N) && !tool.new_done && tool.y_clear) tool_finish("load stopped");
+}
+
+static bool tool_busy(void) {
+    return tool.busy;
+}
+
+static void tool_report(void) {
+    if (!tool.busy) {
+        printf("tool: T%d active\n", active_lane);
+        return;
+    }
+    printf("tool: T%d -> T%d running %lu ms, y-split %s\n", tool.from, tool.to,
+           (unsigned long)(absolute_time_diff_us(tool.t0, get_absolute_time()) / 1000),
+           tool.y_clear ? "clear" : "busy");
+}
+
+// ---------------------- Runout prediction -----------------------
+/*
+  Each lane counts filament from the moment it was loaded (tip at IN), so
+  the tail reaches IN after spool_mm has been fed. Consumption of the
+  active lane is averaged over RUNOUT_RATE_TAU_S, giving an ETA; shortly
+  before it the standby lane is pre-staged so the swap commits at once.
+*/
+
+static struct {
+    int lane;
+    int32_t last_pos;
+    absolute_time_t last_t;
+    float rate_mm_s;
+    float eta_s;                    // < 0 = unknown
+} runout = { .eta_s = -1.0f };
+
+static inline float lane_spool_remaining_mm(const lane_t *L) {
+    if (L->spool_mm <= 0.0f) return -1.0f;
+    float used = (float)(lane_position(L) - L->spool_mark) / LANE_STEPS_PER_MM;
+    float rem = L->spool_mm - used;
+    return rem > 0.0f ? rem : 0.0f;
+}
+
+static inline void lane_spool_set_mm(lane_t *L, float mm) {
+    L->spool_mm = mm;
+    L->spool_mark = lane_position(L);
+}
+
+static void runout_update(absolute_time_t now) {
+    lane_t *A = (active_lane == 1) ? &L1 : &L2;
+    int32_t pos = lane_position(A);
+
+    if (runout.lane != active_lane) {
+        runout.lane = active_lane;
+        runout.last_pos = pos;
+        runout.last_t = now;
+        return;
+    }
+
+    int64_t dt_us = absolute_time_diff_us(runout.last_t, now);
+    if (dt_us < 1000000) return;
+
+    float dt = (float)dt_us / 1e6f;
+    float mm_s = (float)(pos - runout.last_pos) / LANE_STEPS_PER_MM / dt;
+    if (mm_s < 0.0f) mm_s = 0.0f;
+    float k = dt / (RUNOUT_RATE_TAU_S + dt);
+    runout.rate_mm_s += k * (mm_s - runout.rate_mm_s);
+    runout.last_pos = pos;
+    runout.last_t = now;
+
+    float rem = lane_spool_remaining_mm(A);
+    runout.eta_s = (rem >= 0.0f && runout.rate_mm_s > 0.01f) ? rem / runout.rate_mm_s : -1.0f;
+}
+
+static inline bool runout_imminent(void) {
+    return runout.eta_s >= 0.0f && runout.eta_s < (float)RUNOUT_PRESTAGE_S;
+}
+
+static void spool_report(void) {
+    float r1 = lane_spool_remaining_mm(&L1), r2 = lane_spool_remaining_mm(&L2);
+    printf("spool1=%.1fm spool2=%.1fm  active=%d rate=%.2fmm/s eta=%lds\n",
+           r1 < 0 ? -1.0f : r1 / 1000.0f, r2 < 0 ? -1.0f : r2 / 1000.0f,
+           active_lane, runout.rate_mm_s, (long)runout.eta_s);
+}
+
+static bool spool_set(int lane, const char *arg) {
+    if (lane != 1 && lane != 2) return false;
+    float v = strtof(arg, NULL);
+    if (v < 0.0f) return false;
+    size_t n = strlen(arg);
+    float mm = (n && arg[n - 1] == 'g') ? v / SPOOL_G_PER_M * 1000.0f : v * 1000.0f;
+    lane_spool_set_mm((lane == 1) ? &L1 : &L2, mm);
+    spool_report();
+    return true;
+}
+
+static void lane_handle_event(lane_t *L, int lane) {
+    (void)lane;                     // only used by DBG_PRINTF
+    // A completed load means a new spool: its tip is at IN now
+    if (L->event == LANE_EV_LOADED || L->event == LANE_EV_SLIP) {
+        lane_spool_set_mm(L, (float)SPOOL_LENGTH_M * 1000.0f);
+        L->spool_mark = L->move_start;
+    }
+
+    switch (L->event) {
+        case LANE_EV_SLIP:
+            DBG_PRINTF("lane%d: load took more than %d%% over calibrated %ld steps (slip?)\n",
+                       lane, SLIP_WARN_PCT, (long)L->cal_in_out);
+            break;
+        case LANE_EV_LOAD_FAIL:
+            DBG_PRINTF("lane%d: OUT not reached within calibrated distance\n", lane);
+            break;
+        default:
+            break;
+    }
+    L->event = LANE_EV_NONE;
+}
+
+static void din_report(bool reset) {
+    for (size_t i = 0; i < DIN_COUNT; i++) {
+        din_t *d = din_tab[i].d;
+        if (reset) {
+            d->lat_last_us = d->lat_max_us = 0;
+            d->changes = d->false_changes = 0;
+            continue;
+        }
+        printf("%-8s on=%d  assert=%s%lu us release=%lu us  latency last=%lu max=%lu us  changes=%lu false=%lu\n",
+               din_tab[i].name, active_low_on(d), d->instant ? "instant/" : "",
+               (unsigned long)d->assert_n * SCHED_INPUTS_US, (unsigned long)d->release_n * SCHED_INPUTS_US,
+               (unsigned long)d->lat_last_us, (unsigned long)d->lat_max_us,
+               (unsigned long)d->changes, (unsigned long)d->false_changes);
+    }
+}
+
+static bool din_noise_set(const char *profile) {
+#if USE_DIN_NOISE
+    static const struct { const char *name; uint32_t bits; } p[] = {
+        { "off", 0 }, { "bounce", NOISE_BOUNCE }, { "spike", NOISE_SPIKE },
+        { "motor", NOISE_MOTOR }, { "all", NOISE_BOUNCE | NOISE_MOTOR },
+    };
+    for (size_t i = 0; i < sizeof(p) / sizeof(p[0]); i++) {
+        if (strcmp(profile, p[i].name) == 0) {
+            din_noise_profile = p[i].bits;
+            din_report(true);
+            printf("noise: %s, counters reset\n", profile);
+            return true;
+        }
+    }
+    return false;
+#else
+    (void)profile;
+    printf("noise: built without USE_DIN_NOISE\n");
+    return true;
+#endif
+}
+
+static void task_inputs(absolute_time_t now) {
+    (void)now;
+#if USE_DIN_NOISE
+    din_noise_motors = L1.mode != TASK_IDLE || L2.mode != TASK_IDLE;
+#endif
+    bool settling = false;
+    for (size_t i = 0; i < DIN_COUNT; i++) {
+        din_t *d = din_tab[i].d;
+        uint32_t n = d->changes;
+        din_update(d);
+        if (d->changes != n) ev_post_at(EV_INPUT, (uint8_t)i, (uint32_t)to_us_since_boot(d->change_from));
+        settling |= !din_idle(d);
+    }
+#if USE_EVENTS && !USE_DIN_NOISE
+    // Sample only until everything has settled; the next edge restarts it
+    sched_set_period(SCHED_INPUTS, settling ? SCHED_INPUTS_US : 0);
+#else
+    (void)settling;
+#endif
+}
+
+// Manual reverse while the lane's REV button is held (clears a jam)
+static void lane_manual_rev(lane_t *L, int lane, bool rev) {
+    if (rev) {
+        L->jammed = false;
+        if (L->mode != TASK_MANUAL || L->forward != false || L->steps_per_sec != REV_STEPS_PER_SEC) {
+            lane_start_task(L, TASK_MANUAL, REV_STEPS_PER_SEC, false);
+            ev_trace(EVD_MANUAL, lane);
+        }
+    } else if (L->mode == TASK_MANUAL) {
+        lane_stop_task(L);
+    }
+}
+
+// Autoload on IN rising edge
+static void lane_autoload_edge(lane_t *L, int lane, bool in_present, bool out_present) {
+    if (in_present && !L->prev_in_present && !out_present && L->mode == TASK_IDLE && !L->jammed) {
+        lane_start_autoload(L);
+        ev_trace(EVD_AUTOLOAD, lane);
+    }
+}
+
+// StallGuard jam detection
+static void lane_jam_check(lane_t *L, int lane) {
+    if (lane_check_stall(L)) {
+        DBG_PRINTF("lane%d: jam (sg=%u)\n", lane, L->m.tmc.sg_last);
+        ev_trace(EVD_JAM, lane);
+    }
+}
+
+// Flash writes stall stepping: save only between moves
+static void persist_service(void) {
+    if (persist_dirty && L1.mode == TASK_IDLE && L2.mode == TASK_IDLE) {
+        persist.active_lane = (uint32_t)active_lane;
+        persist_save();
+        persist_dirty = false;
+    }
+}
+
+/*
+  Lane server policy: the coordinator runs the real one, but what has to
+  react at the lane stays here: REV buttons, autoload of a new spool,
+  calibration from the CLI and the jam check. Coordinator commands queue
+  behind a running autoload.
+*/
+static void task_lane_local(absolute_time_t now) {
+    (void)now;
+    ev_begin();
+    bool l1_in_present = lane_in_present(&L1);
+    bool l2_in_present = lane_in_present(&L2);
+    bool rev_l1 = active_low_on(&btn_rev_l1);
+    bool rev_l2 = active_low_on(&btn_rev_l2);
+
+    lane_handle_event(&L1, 1);
+    lane_handle_event(&L2, 2);
+    cal_service(active_low_on(&y_split));
+    bool busy = rev_l1 || rev_l2 || cal.state != CAL_IDLE;
+
+    lane_manual_rev(&L1, 1, rev_l1);
+    lane_manual_rev(&L2, 2, rev_l2);
+    if (!busy) {
+        lane_autoload_edge(&L1, 1, l1_in_present, lane_out_present(&L1));
+        lane_autoload_edge(&L2, 2, l2_in_present, lane_out_present(&L2));
+    }
+    persist_service();
+
+    L1.prev_in_present = l1_in_present;
+    L2.prev_in_present = l2_in_present;
+
+    lane_jam_check(&L1, 1);
+    lane_jam_check(&L2, 2);
 
-            // Feed management (pot controls feed_sps)
-            lane_t *A = (active_lane == 1) ? &L1 : &L2;
-            bool A_out_ok = (active_lane == 1) ? l1_out_present : l2_out_present;
+#if USE_EVENTS
+    bool active = busy || persist_dirty || L1.mode != TASK_IDLE || L2.mode != TASK_IDLE;
+    sched_set_period(SCHED_POLICY, active ? EVENT_ACTIVE_TICK_MS * 1000 : 0);
+#endif
+}
+
+static void task_policy(absolute_time_t now) {
+    ev_begin();
+    bool l1_in_present  = lane_in_present(&L1);
+    bool l2_in_present  = lane_in_present(&L2);
+    bool l1_out_present = lane_out_present(&L1);
+    bool l2_out_present = lane_out_present(&L2);
+
+    bool buffer_low  = active_low_on(&buf_low);
+    bool buffer_high = active_low_on(&buf_high);
+
+    bool y_present = active_low_on(&y_split);
+    bool y_clear = !y_present;
+
+    bool rev_l1 = active_low_on(&btn_rev_l1);
+    bool rev_l2 = active_low_on(&btn_rev_l2);
+    bool any_manual = rev_l1 || rev_l2;
+
+    lane_handle_event(&L1, 1);
+    lane_handle_event(&L2, 2);
+    runout_update(now);
+
+    // Calibration and tool changes own their lanes and hold off automatic behavior
+    cal_service(y_present);
+    tool_service(now);
+    bool busy = any_manual || cal.state != CAL_IDLE || tool.busy;
+
+    // ---------- Manual reverse per lane (fixed speed) ----------
+    lane_manual_rev(&L1, 1, rev_l1);
+    lane_manual_rev(&L2, 2, rev_l2);
+
+    // ---------- Normal behavior (only if no manual/calibration) ----------
+    if (!busy) {
+        lane_autoload_edge(&L1, 1, l1_in_present, l1_out_present);
+        lane_autoload_edge(&L2, 2, l2_in_present, l2_out_present);
+
+        // Buffer hysteresis: need_feed when LOW persists and HIGH not active.
+        // Persistence counts from the LOW edge, not from the last policy run
+        if (!buffer_low) {
+            low_seen = false;
+            low_at_boot = false;
+        } else if (!low_seen) {
+            low_seen = true;
+            low_since = now;
+        }
+        bool low_persist = low_at_boot || absolute_time_diff_us(low_since, now) >= (int64_t)tune.low_delay_ms * 1000;
+        bool need_feed = buffer_low && low_persist && !buffer_high;
+#if USE_EVENTS
+        if (buffer_low && !low_persist) ev_alarm_set(ALARM_LOW_DELAY, delayed_by_ms(low_since, (uint32_t)tune.low_delay_ms));
+        else ev_alarm_cancel(ALARM_LOW_DELAY);
+#endif
+        int rate = feed_sps;
+
+#if USE_BUF_HALL
+        // Continuous PI feed from the hall sensor; switches are hard limits (see task_buf)
+        if (bufpi.ok) {
+            need_feed = bufpi.sps > 0 && !buffer_high;
+            rate = bufpi.sps;
+        }
+#endif
+#if USE_EXT_FOLLOWER
+        // Follower drives the feed directly; switches only trim (see task_follow)
+        if (follow.cnt.ok) {
+            need_feed = follow.sps > 0 && !buffer_high;
+            rate = follow.sps;
+        }
+#endif
+
+        // Arm swap when active lane IN empty
+        bool A_in = (active_lane == 1) ? l1_in_present : l2_in_present;
+        if (!A_in && !swap_armed) {
+            swap_armed = true;
+            swap_armed_at = now;
+            swaplog_begin(active_lane, ((active_lane == 1) ? &L1 : &L2)->in_sw.last_edge, now);
+            ev_trace(EVD_SWAP_ARM, active_lane);
+        }
+        if (swap_armed) {
+            if (need_feed) swaplog_mark(SWP_NEED_FEED, now);
+            if (y_clear) swaplog_mark(SWP_Y_CLEAR, now);
+        }
+
+        lane_t *A = (active_lane == 1) ? &L1 : &L2;
+        lane_t *S = (active_lane == 1) ? &L2 : &L1;
+        bool S_out_ok = (active_lane == 1) ? l2_out_present : l1_out_present;
 
-            if (!in_cooldown && need_feed && A_out_ok) {
-                if (A->mode == TASK_IDLE) {
-                    lane_start_task(A, TASK_FEED, feed_sps, true, 0.0f);
-                } else if (A->mode == TASK_FEED) {
-                    A->steps_per_sec = feed_sps; // live update from pot
-                }
+        // Overlapped handoff: pre-advance the standby lane while the old tail
+        // clears, or already shortly before the predicted runout
+        if ((swap_armed || runout_imminent()) && S_out_ok && !S->staged && S->mode == TASK_IDLE && !S->jammed) {
+            int32_t pre = lane_prestage_steps(S);
+            if (pre > 0) {
+                lane_start_move(S, TASK_PRESTAGE, SWAP_PRESTAGE_SPS, true, pre);
+                ev_trace(EVD_PRESTAGE, (active_lane == 1) ? 2 : 1);
             } else {
-                if (A->mode == TASK_FEED) lane_stop_task(A);
+                S->staged = true;
             }
-        } else {
-            // Manual active: stop any auto-feed to avoid fighting
-            if (L1.mode == TASK_FEED) lane_stop_task(&L1);
-            if (L2.mode == TASK_FEED) lane_stop_task(&L2);
         }
 
-        // Update prev flags
-        L1.prev_in_present = l1_in_present;
-        L2.prev_in_present = l2_in_present;
+#if SWAP_TAIL_MODE != 0
+        // Actively clear the outgoing tail so the swap can commit sooner
+        if (swap_armed && S_out_ok && y_present && !tail_tried && !A->jammed &&
+            (A->mode == TASK_IDLE || A->mode == TASK_FEED) &&
+            (SWAP_TAIL_MODE == 1 || !buffer_high)) {
+            lane_start_move(A, TASK_TAIL, SWAP_TAIL_SPS, SWAP_TAIL_MODE == 2, SWAP_TAIL_MAX_STEPS);
+            tail_tried = true;
+            ev_trace(EVD_TAIL, active_lane);
+        }
+        if (A->mode == TASK_TAIL) {
+            if (y_clear) lane_limit_distance(A, SWAP_TAIL_EXTRA_STEPS);
+            if (SWAP_TAIL_MODE == 2 && buffer_high) lane_stop_task(A);
+        }
+#endif
+
+        // Commit the swap as soon as the path is free; no cooldown, the
+        // incoming lane takes over feeding in this same pass
+        bool allow_swap = swap_armed && S_out_ok && !S->jammed;
+#if REQUIRE_Y_CLEAR_FOR_SWAP
+        allow_swap = allow_swap && y_clear;
+#else
+        allow_swap = allow_swap && need_feed;
+#endif
+        if (allow_swap) {
+            if (A->mode == TASK_FEED) lane_stop_task(A);
+            if (S->mode == TASK_PRESTAGE) lane_stop_task(S);    // take over from wherever it got to
+            S->staged = false;
+
+            uint32_t swap_ms = (uint32_t)(absolute_time_diff_us(swap_armed_at, now) / 1000);
+            fstats_swap(swap_ms);
+            DBG_PRINTF("swap: lane%d -> lane%d after %lu ms\n", active_lane, (active_lane == 1) ? 2 : 1,
+                       (unsigned long)swap_ms);
+
+            swaplog_mark(SWP_FLIP, now);
+            active_lane = (active_lane == 1) ? 2 : 1;
+            ev_trace(EVD_SWAP, active_lane);
+            persist_dirty = true;
+            swap_armed = false;
+            tail_tried = false;
+            A = S;
+        }
+
+        // Feed management (pot or follower sets the rate)
+        bool A_out_ok = (active_lane == 1) ? l1_out_present : l2_out_present;
 
-        // Process lanes (pulses + autoload stop)
-        lane_process(&L1);
-        lane_process(&L2);
+        if (need_feed && A_out_ok && !A->jammed) {
+            if (A->mode == TASK_IDLE) {
+                lane_start_task(A, TASK_FEED, rate, true);
+                ev_trace(EVD_FEED_START, active_lane);
+                swaplog_first_step(A->next_step);
+            } else if (A->mode == TASK_FEED) {
+                A->steps_per_sec = rate; // live update
+            }
+        } else if (A->mode == TASK_FEED) {
+            lane_stop_task(A);
+            ev_trace(EVD_FEED_STOP, active_lane);
+        }
 
-        // LED
-        led_state_t led = LED_IDLE;
-        if (any_manual) led = LED_MANUAL_REV;
-        else {
-            if (swap_armed) led = LED_SWAP_ARMED;
-            if (L1.mode == TASK_AUTOLOAD || L2.mode == TASK_AUTOLOAD) led = LED_AUTOLOAD;
-            if (L1.mode == TASK_FEED || L2.mode == TASK_FEED) led = LED_FEEDING;
+        // Active lane still loading: have the feed wait on its queue, or drop it again
+        if (A->mode == TASK_AUTOLOAD && A->cmd_active) {
+            if (need_feed && !A->jammed && A->mq_len == 0) {
+                lane_queue_feed(A, rate);
+                ev_trace(EVD_FEED_START, active_lane);
+            } else if (!need_feed) {
+                A->mq_len = 0;
+            }
         }
-        status_led_update(led, t_us);
+    } else {
+        // Manual/calibration active: stop any auto-feed to avoid fighting
+        if (L1.mode == TASK_FEED) lane_stop_task(&L1);
+        if (L2.mode == TASK_FEED) lane_stop_task(&L2);
+    }
+
+    fstats_sample(now, buffer_low, buffer_high, L1.mode == TASK_FEED || L2.mode == TASK_FEED);
+    persist_service();
+
+    // Update prev flags
+    L1.prev_in_present = l1_in_present;
+    L2.prev_in_present = l2_in_present;
+
+    lane_jam_check(&L1, 1);
+    lane_jam_check(&L2, 2);
+
+#if USE_EVENTS
+    // Between events, tick only while something moves or is pending
+    bool active = busy || swap_armed || persist_dirty || L1.mode != TASK_IDLE || L2.mode != TASK_IDLE;
+    sched_set_period(SCHED_POLICY, active ? EVENT_ACTIVE_TICK_MS * 1000 : 0);
+#endif
+}
+
+static void task_pot(absolute_time_t now) {
+    (void)now;
+    if (tune.feed_sps) {
+        feed_sps = tune.feed_sps;
+    } else {
+#if USE_FEED_POT
+        feed_sps = feed_pot_read_sps();
+#endif
+    }
+    ev_rate(RATE_POT, feed_sps);
+}
+
+static void task_led(absolute_time_t now) {
+    bool any_manual = active_low_on(&btn_rev_l1) || active_low_on(&btn_rev_l2);
+
+    led_state_t led = LED_IDLE;
+    if (any_manual) led = LED_MANUAL_REV;
+    else {
+        if (swap_armed) led = LED_SWAP_ARMED;
+        if (L1.mode == TASK_AUTOLOAD || L2.mode == TASK_AUTOLOAD) led = LED_AUTOLOAD;
+        if (L1.mode == TASK_FEED || L2.mode == TASK_FEED) led = LED_FEEDING;
+        if (L1.jammed || L2.jammed) led = LED_ERROR;
+    }
+    status_led_update(led, to_us_since_boot(now));
+}
+
+static void task_cli(absolute_time_t now) {
+    (void)now;
+    cli_poll(&L1, &L2);
+    capture_service();
+    sweep_service();
+}
+
+static void task_telemetry(absolute_time_t now) {
+    (void)now;
+    bool rev_l1 = active_low_on(&btn_rev_l1);
+    bool rev_l2 = active_low_on(&btn_rev_l2);
+    bool y_present = active_low_on(&y_split);
+
+    printf(
+        "A=%d armed=%d man=%d feed_sps=%d  rev1=%d rev2=%d  "
+        "l1[in=%d out=%d mode=%d stg=%d]  l2[in=%d out=%d mode=%d stg=%d]  "
+        "y=%d yclr=%d  bufL=%d bufH=%d buf=%d%%  rem=%.1fm eta=%lds  swap=%ldms\n",
+        active_lane, swap_armed, rev_l1 || rev_l2, feed_sps,
+        rev_l1, rev_l2,
+        lane_in_present(&L1), lane_out_present(&L1), (int)L1.mode, L1.staged,
+        lane_in_present(&L2), lane_out_present(&L2), (int)L2.mode, L2.staged,
+        y_present, !y_present,
+        active_low_on(&buf_low), active_low_on(&buf_high), bufpi.ok ? (int)bufpi.pct : -1,
+        lane_spool_remaining_mm(active_lane == 1 ? &L1 : &L2) / 1000.0f, (long)runout.eta_s,
+        swaplog_last_total_ms()
+    );
+}
+
+// Step path: runs every loop iteration, outside the scheduler
+static inline void step_service(void) {
+    lane_t *sw[2];
+    int n = 0;
+    if (lane_process(&L1)) sw[n++] = &L1;
+    if (lane_process(&L2)) sw[n++] = &L2;
+    if (n) step_pulse_batch(sw, n);
+    ev_watch_lane(&L1, 1);
+    ev_watch_lane(&L2, 2);
+}
+
+// Next software step due on a lane (hardware backends need no wakeup)
+static inline absolute_time_t lane_next_wake(const lane_t *L, absolute_time_t t) {
+    if (L->mode == TASK_IDLE || L->backend != STEP_BACKEND_SW) return t;
+    return absolute_time_diff_us(L->next_step, t) > 0 ? L->next_step : t;
+}
+
+int main() {
+    wdt_boot_check();
 
+    // Motion and inputs first so feeding can resume within milliseconds of a
+    // reset; USB enumerates in the background once stdio is up at the end.
+    status_led_init();
+
+#if USE_FEED_POT
+    feed_pot_init();
+#endif
+#if USE_BUF_HALL
+    buf_hall_init();
+#endif
+
+    // Inputs
+    din_init(&y_split, PIN_Y_SPLIT, DEB_Y_ASSERT_MS, DEB_Y_RELEASE_MS);
+    din_init(&buf_low, PIN_BUF_LOW, DEB_BUF_LOW_ASSERT_MS, DEB_BUF_LOW_RELEASE_MS);
+    din_init(&buf_high, PIN_BUF_HIGH, DEB_BUF_HIGH_ASSERT_MS, DEB_BUF_HIGH_RELEASE_MS);
+
+    // Manual buttons
+    din_init(&btn_rev_l1, PIN_BTN_REV_L1, DEB_BTN_ASSERT_MS, DEB_BTN_RELEASE_MS);
+    din_init(&btn_rev_l2, PIN_BTN_REV_L2, DEB_BTN_ASSERT_MS, DEB_BTN_RELEASE_MS);
+
+    // Lanes
+    lane_init(&L1, PIN_L1_IN, PIN_L1_OUT, PIN_M1_EN, PIN_M1_DIR, PIN_M1_STEP, M1_DIR_INVERT, TMC_M1_ADDR);
+    lane_init(&L2, PIN_L2_IN, PIN_L2_OUT, PIN_M2_EN, PIN_M2_DIR, PIN_M2_STEP, M2_DIR_INVERT, TMC_M2_ADDR);
+    lane_pwm_init(&L1);
+    lane_pwm_init(&L2);
+    lane_seq_init(&L1);
+    lane_seq_init(&L2);
+
+#if USE_TMC_UART
+    tmc_uart_init();
+    if (!tmc_apply(&L1.m.tmc)) DBG_PRINTF("tmc1: no UART response, STEP/DIR only\n");
+    if (!tmc_apply(&L2.m.tmc)) DBG_PRINTF("tmc2: no UART response, STEP/DIR only\n");
+#endif
+
+    low_since = get_absolute_time();
+    fstats_reset();
+
+    if (persist_load()) {
+        L1.cal_in_out = persist.in_to_out[0];
+        L1.cal_out_y  = persist.out_to_y[0];
+        L2.cal_in_out = persist.in_to_out[1];
+        L2.cal_out_y  = persist.out_to_y[1];
+        active_lane = (int)persist.active_lane;
+    }
+
+    sched_add(SCHED_INPUTS,    "inputs",    SCHED_INPUTS_US, task_inputs);
+    sched_add(SCHED_POLICY,    "policy",    USE_EVENTS ? 0 : SCHED_POLICY_US,
+              LINK_ROLE == 2 ? task_lane_local : task_policy);
+    sched_trigger(SCHED_POLICY);    // boot state (autoload, LOW at boot)
+    sched_add(SCHED_POT,       "pot",       SCHED_POT_US,    task_pot);
+    sched_add(SCHED_LED,       "led",       SCHED_LED_US,    task_led);
+    sched_add(SCHED_CLI,       "cli",       SCHED_CLI_US,    task_cli);
+#if USE_BUF_HALL
+    sched_add(SCHED_BUF,       "buf",       SCHED_BUF_US,    task_buf);
+#endif
+#if USE_EXT_FOLLOWER
+    if (pio_counter_init(&follow.cnt, PIN_EXT_STEP, PIN_EXT_DIR)) {
+        sched_add(SCHED_FOLLOW, "follow",    SCHED_FOLLOW_US, task_follow);
+    } else {
+        DBG_PRINTF("follower: no free PIO state machine\n");
+    }
+#endif
+#if LINK_ROLE
+    link_init();
+    sched_add(SCHED_LINK,      "link",      SCHED_LINK_US,   task_link);
+#endif
+#if USE_FIL_ENCODER
+    fenc_init();
+    sched_add(SCHED_ENC,       "enc",       SCHED_ENC_US,    task_enc);
+#endif
 #if DEBUG_PRINTS
-        if (absolute_time_diff_us(last_dbg, now) > DEBUG_PERIOD_US) {
-            last_dbg = now;
-            DBG_PRINTF(
-                "A=%d armed=%d man=%d feed_sps=%d  rev1=%d rev2=%d  "
-                "l1[in=%d out=%d mode=%d]  l2[in=%d out=%d mode=%d]  "
-                "y=%d yclr=%d  bufL=%d bufH=%d\n",
-                active_lane, swap_armed, any_manual, feed_sps,
-                rev_l1, rev_l2,
-                l1_in_present, l1_out_present, (int)L1.mode,
-                l2_in_present, l2_out_present, (int)L2.mode,
-                y_present, y_clear,
-                buffer_low, buffer_high
-            );
-        }
-#endif
-
-        sleep_us(MAIN_LOOP_SLEEP_US);
+    sched_add(SCHED_TELEMETRY, "telemetry", DEBUG_PERIOD_US, task_telemetry);
+#else
+    sched_add(SCHED_TELEMETRY, "telemetry", 0,               task_telemetry);
+#endif
+
+    stdio_init_all();
+    wdt_start();
+
+    while (true) {
+        wdt_service(&L1, &L2);
+        step_service();
+        ev_dispatch();
+        if (sched_run_one()) continue;
+
+        // Idle: sleep until the next release or software step, capped
+#if USE_EVENTS
+        absolute_time_t wake = sched_next_release(make_timeout_time_us(EVENT_SLEEP_MAX_US));
+        wake = lane_next_wake(&L1, wake);
+        wake = lane_next_wake(&L2, wake);
+        best_effort_wfe_or_timeout(wake);   // an edge or alarm interrupt wakes us early
+#else
+        absolute_time_t wake = sched_next_release(make_timeout_time_us(MAIN_LOOP_SLEEP_US));
+        wake = lane_next_wake(&L1, wake);
+        wake = lane_next_wake(&L2, wake);
+        sleep_until(wake);
+#endif
     }
 
     return 0;